@@ -5,6 +5,7 @@ legacy_modules := power uevent vibrator wifi qemu qemu_tracing
 
 SAVE_MAKEFILES := $(call all-named-subdir-makefiles,$(legacy_modules))
 LEGACY_AUDIO_MAKEFILES := $(call all-named-subdir-makefiles,audio)
+LEGACY_TEST_MAKEFILES := $(call all-named-subdir-makefiles,tests)
 
 LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
@@ -47,3 +48,6 @@ include $(BUILD_SHARED_LIBRARY)
 # legacy_audio builds it's own set of libraries that aren't linked into
 # hardware_legacy
 include $(LEGACY_AUDIO_MAKEFILES)
+
+# benchmarks and their fixtures, built as separate test executables
+include $(LEGACY_TEST_MAKEFILES)
@@ -17,6 +17,7 @@
 #ifndef _HARDWARE_POWER_H
 #define _HARDWARE_POWER_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #if __cplusplus
@@ -33,6 +34,48 @@ enum {
 int acquire_wake_lock(int lock, const char* id);
 int release_wake_lock(const char* id);
 
+// reference-counted locks: the kernel lock is taken on the first
+// acquire and dropped on the last release, after the release delay if
+// one is set. return 0 or an errno value.
+int acquire_wake_lock_ref(int lock, const char* id);
+int release_wake_lock_ref(const char* id);
+void set_wake_lock_release_delay(int delay_ms);
+
+// holds a partial wake lock for at least timeout_ns, on top of any
+// other holds on the id. returns 0 or an errno value.
+int acquire_wake_lock_timeout(const char* id, int64_t timeout_ns);
+
+struct wake_lock_info {
+    int refs;               // current counted references
+    int held;               // whether the kernel lock is held
+    uint32_t acquires;      // acquire calls of any kind
+    uint32_t releases;
+    uint32_t acquire_writes;
+    uint32_t release_writes;
+    uint32_t coalesced;     // calls that needed no write
+    uint32_t contended;     // edges that had to wait for another thread
+    uint64_t total_held_ns; // kernel lock held time, including the current hold
+    uint64_t max_held_ns;
+    int64_t last_acquire_ns; // CLOCK_MONOTONIC, 0 if never
+};
+
+#define WAKE_LOCK_ID_MAX 64
+
+struct wake_lock_stat {
+    char id[WAKE_LOCK_ID_MAX];  // truncated if longer
+    struct wake_lock_info info;
+};
+
+// returns 0, or -1 if the id hasn't been used in this process.
+int get_wake_lock_info(const char* id, struct wake_lock_info *info);
+
+// fills up to max entries, one per id used in this process, and
+// returns how many were filled.
+int get_wake_lock_stats(struct wake_lock_stat *stats, int max);
+
+// writes a line of text per id; returns the length written.
+int dump_wake_locks(char *buf, size_t len);
+
 
 #if __cplusplus
 } // extern "C"
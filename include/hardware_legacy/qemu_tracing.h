@@ -23,11 +23,39 @@ extern "C" {
 
 int qemu_start_tracing();
 int qemu_stop_tracing();
+
+// The mapping calls return 0 on success, -1 if the qemu driver cannot be
+// opened, or a positive errno if a record could not be written (EINVAL
+// for a name that is too long). qemu_add_mapping() and
+// qemu_remove_mapping() used to return the negative result of open()
+// instead, and to ignore write errors. The batch calls stop at the first
+// record that fails; the records before it have been applied.
 int qemu_add_mapping(unsigned int addr, const char *name);
 int qemu_remove_mapping(unsigned int addr);
+int qemu_add_mappings(const unsigned int *addrs, const char * const *names, int count);
+int qemu_remove_mappings(const unsigned int *addrs, int count);
+
+// Nestable tracing regions; only the outermost begin and end toggle
+// tracing. Return 0 on success.
+int qemu_trace_region_begin();
+int qemu_trace_region_end();
+
+#define QEMU_TRACE_BEGIN()  qemu_trace_region_begin()
+#define QEMU_TRACE_END()    qemu_trace_region_end()
 
 #if __cplusplus
 } // extern "C"
+
+// Traces the enclosing scope.
+class QemuTraceRegion {
+public:
+    QemuTraceRegion() { qemu_trace_region_begin(); }
+    ~QemuTraceRegion() { qemu_trace_region_end(); }
+
+private:
+    QemuTraceRegion(const QemuTraceRegion&);
+    QemuTraceRegion& operator=(const QemuTraceRegion&);
+};
 #endif
 
 #endif // _HARDWARE_QEMU_TRACING_H
@@ -17,16 +17,64 @@
 #ifndef _HARDWARE_UEVENT_H
 #define _HARDWARE_UEVENT_H
 
+#include <stddef.h>
+
 #if __cplusplus
 extern "C" {
 #endif
 
+#define UEVENT_MAX_KEYS 32
+
+struct uevent_key {
+    const char *key;        /* not NUL-terminated; see key_len */
+    size_t key_len;
+    const char *value;
+};
+
+/* A uevent split into its KEY=value pairs; pointers refer into msg */
+struct uevent {
+    const char *msg;
+    int msg_len;
+    const char *action;
+    const char *devpath;
+    const char *subsystem;
+    int num_keys;
+    struct uevent_key keys[UEVENT_MAX_KEYS];
+};
+
+/* The most events one uevent_next_events() call returns */
+#define UEVENT_BATCH_MAX 64
+
+struct uevent_batch_entry {
+    char *buffer;
+    int buffer_length;
+    int length;             /* set on return */
+};
+
+/* NULL fields match anything */
+struct uevent_filter {
+    const char *subsystem;
+    const char *action;
+    const char *devpath_prefix;
+};
+
 int uevent_init();
 int uevent_get_fd();
 int uevent_next_event(char* buffer, int buffer_length);
+int uevent_next_events(struct uevent_batch_entry *events, int count);
+int uevent_reactor_start(int coalesce_ms);
+int uevent_reactor_stop();
+int uevent_reactor_get_fd();
 int uevent_add_native_handler(void (*handler)(void *data, const char *msg, int msg_len),
                               void *handler_data);
 int uevent_remove_native_handler(void (*handler)(void *data, const char *msg, int msg_len));
+int uevent_add_filtered_handler(const struct uevent_filter *filter,
+                                void (*handler)(void *data, const struct uevent *event),
+                                void *handler_data);
+int uevent_remove_filtered_handler(void (*handler)(void *data, const struct uevent *event));
+const char *uevent_get_value(const struct uevent *event, const char *key);
+/* NULL-terminated allowlists, NULL for any; both NULL removes the filter */
+int uevent_set_filter(const char * const *subsystems, const char * const *actions);
 
 #if __cplusplus
 } // extern "C"
@@ -44,6 +44,28 @@ int vibrator_on(int timeout_ms);
  */
 int vibrator_off();
 
+/**
+ * Play a vibration pattern in the background. The durations alternate
+ * between off and on, starting with off, like the framework's
+ * Vibrator.vibrate(long[], int). Starting a pattern replaces the one
+ * playing; vibrator_on() and vibrator_off() also stop it.
+ *
+ * @param durations_ms the off/on durations in milliseconds
+ * @param count the number of durations
+ * @param repeat the index to loop back to after the last duration,
+ *        or -1 to play the pattern once
+ *
+ * @return 0 if successful, -1 if error
+ */
+int vibrator_pattern(const int *durations_ms, int count, int repeat);
+
+/**
+ * Stop the pattern playing, if any, and turn the vibrator off.
+ *
+ * @return 0 if successful, -1 if error
+ */
+int vibrator_cancel();
+
 #if __cplusplus
 }  // extern "C"
 #endif
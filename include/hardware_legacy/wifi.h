@@ -17,6 +17,8 @@
 #ifndef _WIFI_H
 #define _WIFI_H
 
+#include <stdint.h>
+
 #if __cplusplus
 extern "C" {
 #endif
@@ -71,6 +73,45 @@ int wifi_connect_to_supplicant();
  */
 void wifi_close_supplicant_connection();
 
+/* Per-stage wall-clock times reported by wifi_start_pipelined() */
+struct wifi_startup_timing {
+    int64_t driver_load_ms;       /* module insertion and firmware load */
+    int64_t file_prep_ms;         /* config/entropy files, overlaps driver load */
+    int64_t supplicant_start_ms;  /* ctl.start until the service is running */
+    int64_t connect_ms;           /* until control and monitor are connected */
+    int64_t total_ms;
+};
+
+/**
+ * Load the driver, start supplicant and connect to it in one call.
+ * Config and entropy file preparation and stale socket cleanup run
+ * concurrently with driver loading; supplicant is started as soon as
+ * the driver reports ready, and the connection is made as soon as its
+ * control socket appears.
+ *
+ * @param timing if not NULL, receives per-stage timings, also on failure
+ *
+ * @return 0 on success, < 0 on failure.
+ */
+int wifi_start_pipelined(int p2pSupported, struct wifi_startup_timing *timing);
+
+/**
+ * Open a connection to supplicant for an additional interface, such as a
+ * P2P group or SoftAP interface. Each interface gets its own pool of
+ * control connections, so commands for different interfaces can be
+ * issued concurrently. Events for every connected interface are
+ * delivered through wifi_wait_for_event(), prefixed with "IFNAME=".
+ *
+ * @return 0 on success, < 0 on failure.
+ */
+int wifi_connect_iface_to_supplicant(const char *ifname);
+
+/**
+ * Close the connection opened by wifi_connect_iface_to_supplicant(),
+ * after waiting for commands in flight on that interface to complete.
+ */
+void wifi_close_iface_connection(const char *ifname);
+
 /**
  * wifi_wait_for_event() performs a blocking call to 
  * get a Wi-Fi event and returns a string representing 
@@ -85,6 +126,87 @@ void wifi_close_supplicant_connection();
  */
 int wifi_wait_for_event(char *buf, size_t len);
 
+/**
+ * Event types reported by wifi_parse_event(). The numeric values are
+ * stable so they can be mirrored by the framework.
+ */
+enum wifi_event_type {
+    WIFI_EVENT_UNKNOWN = 0,
+    WIFI_EVENT_CONNECTED,
+    WIFI_EVENT_DISCONNECTED,
+    WIFI_EVENT_STATE_CHANGE,
+    WIFI_EVENT_SCAN_RESULTS,
+    WIFI_EVENT_LINK_SPEED,
+    WIFI_EVENT_TERMINATING,
+    WIFI_EVENT_DRIVER_STATE,
+    WIFI_EVENT_EAP_FAILURE,
+    WIFI_EVENT_ASSOC_REJECT,
+    WIFI_EVENT_IGNORE,
+    WIFI_EVENT_WPS_SUCCESS,
+    WIFI_EVENT_WPS_FAIL,
+    WIFI_EVENT_WPS_OVERLAP_DETECTED,
+    WIFI_EVENT_WPS_TIMEOUT,
+    WIFI_EVENT_P2P_DEVICE_FOUND,
+    WIFI_EVENT_P2P_DEVICE_LOST,
+    WIFI_EVENT_P2P_FIND_STOPPED,
+    WIFI_EVENT_P2P_GO_NEG_REQUEST,
+    WIFI_EVENT_P2P_GO_NEG_SUCCESS,
+    WIFI_EVENT_P2P_GO_NEG_FAILURE,
+    WIFI_EVENT_P2P_GROUP_FORMATION_SUCCESS,
+    WIFI_EVENT_P2P_GROUP_FORMATION_FAILURE,
+    WIFI_EVENT_P2P_GROUP_STARTED,
+    WIFI_EVENT_P2P_GROUP_REMOVED,
+    WIFI_EVENT_P2P_INVITATION_RECEIVED,
+    WIFI_EVENT_P2P_INVITATION_RESULT,
+    WIFI_EVENT_P2P_PROV_DISC_PBC_REQ,
+    WIFI_EVENT_P2P_PROV_DISC_PBC_RESP,
+    WIFI_EVENT_P2P_PROV_DISC_ENTER_PIN,
+    WIFI_EVENT_P2P_PROV_DISC_SHOW_PIN,
+    WIFI_EVENT_P2P_PROV_DISC_FAILURE,
+    WIFI_EVENT_P2P_SERV_DISC_RESP,
+    WIFI_EVENT_AP_STA_CONNECTED,
+    WIFI_EVENT_AP_STA_DISCONNECTED
+};
+
+/* A (pointer, length) view into an event buffer; not NUL-terminated. */
+struct wifi_event_span {
+    const char *ptr;
+    size_t len;
+};
+
+/* Positional arguments are reported with an empty key. */
+struct wifi_event_arg {
+    struct wifi_event_span key;
+    struct wifi_event_span value;
+};
+
+#define WIFI_EVENT_MAX_ARGS	16
+
+struct wifi_event {
+    struct wifi_event_span iface;   /* empty if no IFNAME= prefix */
+    struct wifi_event_span name;    /* e.g. "CTRL-EVENT-CONNECTED" */
+    int type;                       /* enum wifi_event_type */
+    int nargs;
+    struct wifi_event_arg args[WIFI_EVENT_MAX_ARGS];
+};
+
+/**
+ * wifi_parse_event() splits an event string, as returned by
+ * wifi_wait_for_event(), into its interface, event type and
+ * key=value arguments. No copy is made: every span points into 'buf',
+ * which must stay valid for as long as 'event' is used. Quoted values
+ * ('...' or "...") are returned without their quotes. Arguments beyond
+ * WIFI_EVENT_MAX_ARGS are dropped.
+ *
+ * @param buf the event string
+ * @param len the length of the event string
+ * @param event receives the parsed view
+ *
+ * @return the event type, WIFI_EVENT_UNKNOWN if the name is not recognized,
+ *         or < 0 if the string is not an event.
+ */
+int wifi_parse_event(const char *buf, size_t len, struct wifi_event *event);
+
 /**
  * wifi_command() issues a command to the Wi-Fi driver.
  *
@@ -106,6 +228,86 @@ int wifi_wait_for_event(char *buf, size_t len);
  */
 int wifi_command(const char *command, char *reply, size_t *reply_len);
 
+/**
+ * wifi_iface_command() is wifi_command() for a connection opened with
+ * wifi_connect_iface_to_supplicant().
+ *
+ * @return 0 if successful, < 0 if an error.
+ */
+int wifi_iface_command(const char *ifname, const char *command,
+                       char *reply, size_t *reply_len);
+
+/**
+ * wifi_command_alloc() is wifi_command() for replies of unknown size.
+ * The reply is returned NUL-terminated in a buffer owned by the library,
+ * which grows (re-issuing the command) until the reply fits. Use it for
+ * query commands only. Release the buffer with wifi_release_reply().
+ *
+ * @param reply receives the reply buffer
+ * @param reply_len receives the length of the reply
+ *
+ * @return 0 if successful, < 0 if an error.
+ */
+int wifi_command_alloc(const char *command, char **reply, size_t *reply_len);
+
+/**
+ * Fetch the full scan result list in one call. The results are read in
+ * chunks with "BSS RANGE=<id>- MASK=<mask>" until the supplicant marks
+ * the last entry, and returned concatenated in a library-owned buffer
+ * that must be released with wifi_release_reply().
+ *
+ * @param mask the BSS field mask, in the supplicant's "0x..." form; it
+ *        should include the entry delimiter bit. The id bit is always
+ *        added, since the next chunk starts after the last id returned.
+ *
+ * @return 0 if the whole list was read, < 0 if any chunk failed; a
+ *         partial list is never returned.
+ */
+int wifi_get_scan_results(const char *mask, char **reply, size_t *reply_len);
+
+/**
+ * Return a buffer from wifi_command_alloc() or wifi_get_scan_results()
+ * to the library.
+ */
+void wifi_release_reply(char *reply);
+
+#define WIFI_CMD_HIST_BUCKETS	104
+
+/* Latency statistics for one supplicant command verb */
+struct wifi_cmd_stats {
+    uint32_t count;
+    uint32_t in_flight;
+    uint32_t timeouts;
+    uint32_t failures;     /* transport errors and "FAIL" replies */
+    uint64_t total_us;
+    uint32_t max_us;
+    uint32_t buckets[WIFI_CMD_HIST_BUCKETS];
+};
+
+/**
+ * Copy the latency statistics recorded for commands starting with 'verb'
+ * (e.g. "SCAN_RESULTS"), or for commands with no dedicated entry if
+ * 'verb' is NULL. Counters are read individually while commands may be
+ * running, so they are not an atomic snapshot.
+ *
+ * @return 0 on success, < 0 if 'verb' isn't tracked separately.
+ */
+int wifi_get_command_stats(const char *verb, struct wifi_cmd_stats *stats);
+
+/**
+ * Return the lower bound, in microseconds, of histogram bucket 'bucket'.
+ * Buckets are log-linear: 4 linear steps per power of two.
+ */
+uint32_t wifi_cmd_hist_bucket_us(int bucket);
+
+/**
+ * Write a text summary of the command statistics, one line per verb
+ * that has been used, into 'buf'.
+ *
+ * @return the number of characters written, excluding the NUL.
+ */
+int wifi_dump_command_stats(char *buf, size_t len);
+
 /**
  * do_dhcp_request() issues a dhcp request and returns the acquired
  * information. 
@@ -130,6 +332,62 @@ int do_dhcp_request(int *ipaddr, int *gateway, int *mask,
  */
 const char *get_dhcp_error_string();
 
+/**
+ * Result of an asynchronous DHCP request. The fields match the
+ * parameters of do_dhcp_request(); 'status' is 0 on success and < 0
+ * on failure.
+ */
+struct wifi_dhcp_result {
+    int status;
+    int ipaddr;
+    int gateway;
+    int mask;
+    int dns1;
+    int dns2;
+    int server;
+    int lease;
+};
+
+typedef void (*wifi_dhcp_callback)(const struct wifi_dhcp_result *result, void *arg);
+
+/**
+ * Start a DHCP request on the primary interface without blocking. When
+ * it finishes, 'callback' (if not NULL) is called on the worker thread,
+ * and the fd from wifi_dhcp_get_fd() becomes readable. The address,
+ * mask and gateway are taken from the kernel's rtnetlink view of the
+ * interface; if the address was already removed again (a lost lease),
+ * the result has status -1 and no address. The interface control socket
+ * stays open across requests (e.g. renewals) until wifi_dhcp_close().
+ *
+ * The callback runs after the request is finished and the fd has been
+ * signalled, so it may call wifi_dhcp_get_result(), start the next
+ * request with wifi_dhcp_request_async(), or call wifi_dhcp_close().
+ *
+ * @return 0 if the request was started, < 0 if an error or if a
+ *         request is already running (errno EBUSY).
+ */
+int wifi_dhcp_request_async(wifi_dhcp_callback callback, void *arg);
+
+/**
+ * Return an fd that becomes readable when an asynchronous DHCP request
+ * completes, or -1 on error.
+ */
+int wifi_dhcp_get_fd();
+
+/**
+ * Collect the result of the last completed asynchronous DHCP request
+ * and reset the fd from wifi_dhcp_get_fd().
+ *
+ * @return 0 if a result was copied, -1 if none is pending.
+ */
+int wifi_dhcp_get_result(struct wifi_dhcp_result *result);
+
+/**
+ * Wait for any running asynchronous DHCP request and close the
+ * interface control socket kept open for it.
+ */
+void wifi_dhcp_close();
+
 /**
  * Return the path to requested firmware
  */
@@ -143,6 +401,21 @@ const char *wifi_get_fw_path(int fw_type);
  */
 int wifi_change_fw_path(const char *fwpath);
 
+/**
+ * Switch a loaded driver to the firmware for 'fw_type' (one of
+ * WIFI_GET_FW_PATH_*) without unloading it: writes the firmware path,
+ * cycles the interface down and up so the driver reloads firmware, and
+ * waits for the firmware-ready uevent: the firmware loader finishing for
+ * the interface's device, or a change/add uevent for the interface.
+ * Kernels that load firmware directly, and drivers that don't announce
+ * the interface again, send neither; the call then waits the full
+ * timeout and returns -2 even though the switch may have worked.
+ *
+ * @return 0 on success, -2 if the firmware did not report ready within
+ *         timeout_ms, other values < 0 on failure.
+ */
+int wifi_switch_fw_mode(int fw_type, int timeout_ms);
+
 /**
  * Check and create if necessary initial entropy file
  */
@@ -46,10 +46,10 @@ const char * const NEW_PATHS[] = {
     "/sys/power/wake_unlock",
 };
 
-//XXX static pthread_once_t g_initialized = THREAD_ONCE_INIT;
-static int g_initialized = 0;
+static pthread_once_t g_initialized = PTHREAD_ONCE_INIT;
 static int g_fds[OUR_FD_COUNT];
 static int g_error = 1;
+static volatile int g_timeout_native;    /* wake_lock takes "<id> <ns>" */
 
 static int64_t systemTime()
 {
@@ -64,10 +64,12 @@ open_file_descriptors(const char * const paths[])
 {
     int i;
     for (i=0; i<OUR_FD_COUNT; i++) {
-        int fd = open(paths[i], O_RDWR);
+        int fd = open(paths[i], O_RDWR | O_CLOEXEC);
         if (fd < 0) {
             fprintf(stderr, "fatal error opening \"%s\"\n", paths[i]);
             g_error = errno;
+            while (--i >= 0)
+                close(g_fds[i]);
             return -1;
         }
         g_fds[i] = fd;
@@ -77,49 +79,637 @@ open_file_descriptors(const char * const paths[])
     return 0;
 }
 
+static void
+open_fds_once(void)
+{
+    if(open_file_descriptors(NEW_PATHS) < 0)
+        open_file_descriptors(OLD_PATHS);
+    else
+        g_timeout_native = 1;
+}
+
 static inline void
 initialize_fds(void)
 {
-    // XXX: should be this:
-    //pthread_once(&g_initialized, open_file_descriptors);
-    // XXX: not this:
-    if (g_initialized == 0) {
-        if(open_file_descriptors(NEW_PATHS) < 0)
-            open_file_descriptors(OLD_PATHS);
-        g_initialized = 1;
+    pthread_once(&g_initialized, open_fds_once);
+}
+
+/*
+ * In-process wake lock state. The kernel lock for an id is held while the
+ * id has counted references or a plain acquire_wake_lock(); for the
+ * counted and timed calls only changes of that state are written to
+ * sysfs. A counted release may be deferred by the release delay, so a
+ * quick re-acquire costs no writes at all. Plain acquire_wake_lock() and
+ * release_wake_lock() always write through: kernel wake locks are global
+ * by name, so another process (or the other copy of this file in
+ * libpower) may have changed the kernel's state behind this cache.
+ *
+ * Entries live in an open-addressed table and are never removed, so a
+ * lookup takes no lock: a new id is claimed by publishing its copy with
+ * a compare-and-swap. Reference counts are atomic, and the entry's mutex
+ * is only taken on a 0->1 or 1->0 edge to bring the kernel in line. The
+ * count only leaves zero under that mutex, after the kernel holds the
+ * lock, so a caller that bumps a non-zero count never runs unprotected.
+ */
+#define WAKE_LOCK_TABLE_SIZE    256     /* power of two */
+
+struct wake_lock_entry {
+    char * volatile id;
+    volatile int refs;
+    volatile int plain;     /* held through acquire_wake_lock() */
+    int ref_pending;        /* a 0->1 acquire is syncing the kernel */
+    int held;               /* what the kernel was last told */
+    int64_t held_since;
+    int64_t held_until;     /* when the kernel times it out, 0 if never */
+    int64_t timed_until;    /* end of the latest timed acquire */
+    volatile int64_t release_at;    /* deferred release time, 0 if none */
+    pthread_mutex_t lock;
+    struct wake_lock_info info;
+};
+
+static struct wake_lock_entry g_entries[WAKE_LOCK_TABLE_SIZE];
+static pthread_once_t g_entries_initialized = PTHREAD_ONCE_INIT;
+static volatile int g_release_delay_ms;
+
+static pthread_mutex_t g_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_timer_cond = PTHREAD_COND_INITIALIZER;    /* see init_entries_once() */
+static int g_timer_started;
+static int g_timer_kicked;
+
+static void
+init_entries_once(void)
+{
+    int i;
+    for (i = 0; i < WAKE_LOCK_TABLE_SIZE; i++)
+        pthread_mutex_init(&g_entries[i].lock, NULL);
+#ifndef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC
+    {
+        /* deadlines are systemTime(); have the timer wait on that clock */
+        pthread_condattr_t attr;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&g_timer_cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+#endif
+}
+
+static uint32_t
+hash_id(const char* id)
+{
+    uint32_t h = 2166136261u;
+    while (*id)
+        h = (h ^ (unsigned char) *id++) * 16777619u;
+    return h;
+}
+
+static struct wake_lock_entry *
+find_entry(const char* id, int create)
+{
+    uint32_t h = hash_id(id);
+    char *copy = NULL;
+    int i;
+
+    pthread_once(&g_entries_initialized, init_entries_once);
+    for (i = 0; i < WAKE_LOCK_TABLE_SIZE; i++) {
+        struct wake_lock_entry *e = &g_entries[(h + i) & (WAKE_LOCK_TABLE_SIZE - 1)];
+        char *cur = e->id;
+
+        if (cur == NULL) {
+            if (!create)
+                break;
+            if (copy == NULL && (copy = strdup(id)) == NULL)
+                return NULL;
+            cur = __sync_val_compare_and_swap(&e->id, NULL, copy);
+            if (cur == NULL)
+                return e;
+            /* another thread claimed the slot; see whose id it is */
+        }
+        if (strcmp(cur, id) == 0) {
+            free(copy);
+            return e;
+        }
+    }
+    free(copy);
+    return NULL;
+}
+
+static ssize_t sync_entry_locked(struct wake_lock_entry *e);
+
+static void
+lock_entry(struct wake_lock_entry *e)
+{
+    if (pthread_mutex_trylock(&e->lock) != 0) {
+        __sync_fetch_and_add(&e->info.contended, 1);
+        pthread_mutex_lock(&e->lock);
+    }
+}
+
+static void
+note_acquire(struct wake_lock_entry *e)
+{
+    __sync_fetch_and_add(&e->info.acquires, 1);
+    __sync_lock_test_and_set(&e->info.last_acquire_ns, systemTime());
+}
+
+/* Accounting for the kernel lock; called with the entry's lock held */
+static void
+set_held_locked(struct wake_lock_entry *e, int64_t now, int64_t until)
+{
+    if (!e->held)
+        e->held_since = now;
+    e->held = 1;
+    e->held_until = until;
+}
+
+static void
+set_released_locked(struct wake_lock_entry *e, int64_t end)
+{
+    uint64_t held_ns;
+
+    if (!e->held)
+        return;
+    held_ns = end > e->held_since ? end - e->held_since : 0;
+    e->info.total_held_ns += held_ns;
+    if (held_ns > e->info.max_held_ns)
+        e->info.max_held_ns = held_ns;
+    e->held = 0;
+}
+
+/*
+ * The shared timer: one thread, started on first use, that runs the
+ * deferred releases and the timed locks the kernel can't time out itself.
+ * Each entry carries its own deadline, so the table doubles as the wheel.
+ */
+static void *
+release_timer_thread(void *arg)
+{
+    for (;;) {
+        int64_t now = systemTime(), next = 0;
+        int i;
+
+        for (i = 0; i < WAKE_LOCK_TABLE_SIZE; i++) {
+            struct wake_lock_entry *e = &g_entries[i];
+            int64_t at;
+
+            if (e->id == NULL)
+                continue;
+            pthread_mutex_lock(&e->lock);
+            at = e->release_at;
+            if (at != 0 && at <= now)
+                sync_entry_locked(e);
+            else if (at != 0 && (next == 0 || at < next))
+                next = at;
+            pthread_mutex_unlock(&e->lock);
+        }
+
+        pthread_mutex_lock(&g_timer_lock);
+        if (!g_timer_kicked) {
+            if (next == 0) {
+                pthread_cond_wait(&g_timer_cond, &g_timer_lock);
+            } else {
+                struct timespec ts;
+
+                ts.tv_sec = next / 1000000000LL;
+                ts.tv_nsec = next % 1000000000LL;
+#ifdef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC
+                pthread_cond_timedwait_monotonic_np(&g_timer_cond, &g_timer_lock, &ts);
+#else
+                pthread_cond_timedwait(&g_timer_cond, &g_timer_lock, &ts);
+#endif
+            }
+        }
+        g_timer_kicked = 0;
+        pthread_mutex_unlock(&g_timer_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Has the timer thread sync the entry at 'at'. Called with the entry's
+ * lock held. Returns -1 if the thread couldn't be started.
+ */
+static int
+arm_release_locked(struct wake_lock_entry *e, int64_t at)
+{
+    pthread_t thread;
+    int started;
+
+    pthread_mutex_lock(&g_timer_lock);
+    if (!g_timer_started) {
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        g_timer_started = pthread_create(&thread, &attr, release_timer_thread, NULL) == 0;
+        pthread_attr_destroy(&attr);
+    }
+    started = g_timer_started;
+    if (started) {
+        e->release_at = at;
+        g_timer_kicked = 1;
+        pthread_cond_signal(&g_timer_cond);
+    }
+    pthread_mutex_unlock(&g_timer_lock);
+    return started ? 0 : -1;
+}
+
+/* Called with the entry's lock held */
+static void
+defer_release_locked(struct wake_lock_entry *e)
+{
+    if (arm_release_locked(e, systemTime() + g_release_delay_ms * 1000000LL) < 0)
+        sync_entry_locked(e);
+}
+
+static ssize_t
+write_timed_lock(struct wake_lock_entry *e, int64_t timeout_ns)
+{
+    char buf[128];
+    ssize_t ret;
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "%s %lld", e->id, (long long) timeout_ns);
+    if (len >= (int) sizeof(buf))
+        return -1;
+    ret = write(g_fds[ACQUIRE_PARTIAL_WAKE_LOCK], buf, len);
+    if (ret < 0 && errno == EINVAL) {
+        /* built without timeout support; stop trying */
+        g_timeout_native = 0;
+    }
+    return ret;
+}
+
+/*
+ * Brings the kernel lock in line with the entry's state, unless a deferred
+ * release is still pending. The kernel should hold the lock indefinitely
+ * while there are references or a plain acquire, and otherwise until the
+ * end of any timed acquire. Called with the entry's lock held. Returns the
+ * write() result, or strlen(id) if nothing had to be written.
+ */
+static ssize_t
+sync_entry_locked(struct wake_lock_entry *e)
+{
+    int64_t now = systemTime();
+    int kernel_held = e->held && (e->held_until == 0 || e->held_until > now);
+    int indefinite = e->refs > 0 || e->ref_pending || e->plain;
+    int timed = e->timed_until > now;
+    ssize_t ret = strlen(e->id);
+
+    if (e->held && !kernel_held) {
+        /* the kernel timed it out */
+        set_released_locked(e, e->held_until);
+    }
+    if (!indefinite && !timed && e->release_at != 0 && e->release_at > now)
+        return ret;
+    e->release_at = 0;
+
+    if (indefinite) {
+        if (kernel_held && e->held_until == 0) {
+            __sync_fetch_and_add(&e->info.coalesced, 1);
+            return ret;
+        }
+        /* a plain write also cancels a kernel timeout */
+        ret = write(g_fds[ACQUIRE_PARTIAL_WAKE_LOCK], e->id, strlen(e->id));
+        e->info.acquire_writes++;
+        if (ret >= 0)
+            set_held_locked(e, now, 0);
+        return ret;
+    }
+
+    if (timed) {
+        if (kernel_held && e->held_until >= e->timed_until) {
+            __sync_fetch_and_add(&e->info.coalesced, 1);
+            return ret;
+        }
+        if (g_timeout_native) {
+            ret = write_timed_lock(e, e->timed_until - now);
+            e->info.acquire_writes++;
+            if (ret >= 0) {
+                set_held_locked(e, now, e->timed_until);
+                return ret;
+            }
+        }
+        /* hold it ourselves and let the timer thread release it */
+        if (!kernel_held || e->held_until != 0) {
+            ret = write(g_fds[ACQUIRE_PARTIAL_WAKE_LOCK], e->id, strlen(e->id));
+            e->info.acquire_writes++;
+            if (ret < 0)
+                return ret;
+            set_held_locked(e, now, 0);
+        }
+        if (arm_release_locked(e, e->timed_until) < 0)
+            ALOGE("no timer for wake lock %s; it stays held", e->id);
+        return ret;
+    }
+
+    if (!kernel_held) {
+        __sync_fetch_and_add(&e->info.coalesced, 1);
+        return ret;
     }
+    ret = write(g_fds[RELEASE_WAKE_LOCK], e->id, strlen(e->id));
+    e->info.release_writes++;
+    if (ret >= 0)
+        set_released_locked(e, now);
+    return ret;
 }
 
 int
 acquire_wake_lock(int lock, const char* id)
 {
+    struct wake_lock_entry *e;
+    ssize_t ret;
+
     initialize_fds();
 
 //    ALOGI("acquire_wake_lock lock=%d id='%s'\n", lock, id);
 
     if (g_error) return g_error;
 
-    int fd;
-
-    if (lock == PARTIAL_WAKE_LOCK) {
-        fd = g_fds[ACQUIRE_PARTIAL_WAKE_LOCK];
-    }
-    else {
+    if (lock != PARTIAL_WAKE_LOCK) {
         return EINVAL;
     }
 
-    return write(fd, id, strlen(id));
+    e = find_entry(id, 1);
+    if (e == NULL) {
+        /* table full; fall back to writing through */
+        return write(g_fds[ACQUIRE_PARTIAL_WAKE_LOCK], id, strlen(id));
+    }
+    note_acquire(e);
+    lock_entry(e);
+    ret = write(g_fds[ACQUIRE_PARTIAL_WAKE_LOCK], id, strlen(id));
+    e->info.acquire_writes++;
+    if (ret >= 0) {
+        e->plain = 1;
+        set_held_locked(e, systemTime(), 0);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return ret;
 }
 
 int
 release_wake_lock(const char* id)
 {
+    struct wake_lock_entry *e;
+    ssize_t len;
+
     initialize_fds();
 
 //    ALOGI("release_wake_lock id='%s'\n", id);
 
     if (g_error) return g_error;
 
-    ssize_t len = write(g_fds[RELEASE_WAKE_LOCK], id, strlen(id));
+    e = find_entry(id, 0);
+    if (e == NULL) {
+        /* not taken through this library; pass it on */
+        len = write(g_fds[RELEASE_WAKE_LOCK], id, strlen(id));
+    } else {
+        int64_t now = systemTime();
+
+        lock_entry(e);
+        e->plain = 0;
+        e->release_at = 0;
+        if (e->refs > 0 || e->ref_pending || e->timed_until > now) {
+            /* still needed by counted or timed holders in this process */
+            len = sync_entry_locked(e);
+        } else {
+            len = write(g_fds[RELEASE_WAKE_LOCK], id, strlen(id));
+            e->info.release_writes++;
+            if (len >= 0)
+                set_released_locked(e, now);
+        }
+        pthread_mutex_unlock(&e->lock);
+    }
     return len >= 0;
 }
+
+int
+acquire_wake_lock_ref(int lock, const char* id)
+{
+    struct wake_lock_entry *e;
+    int refs;
+
+    initialize_fds();
+
+    if (g_error) return g_error;
+
+    if (lock != PARTIAL_WAKE_LOCK) {
+        return EINVAL;
+    }
+
+    e = find_entry(id, 1);
+    if (e == NULL)
+        return ENOMEM;
+    note_acquire(e);
+    /* refs only leaves 0 under the lock, once the kernel holds the lock */
+    while ((refs = e->refs) > 0) {
+        if (__sync_bool_compare_and_swap(&e->refs, refs, refs + 1)) {
+            __sync_fetch_and_add(&e->info.coalesced, 1);
+            return 0;
+        }
+    }
+
+    lock_entry(e);
+    while ((refs = e->refs) > 0) {
+        if (__sync_bool_compare_and_swap(&e->refs, refs, refs + 1)) {
+            __sync_fetch_and_add(&e->info.coalesced, 1);
+            pthread_mutex_unlock(&e->lock);
+            return 0;
+        }
+    }
+
+    /* 0->1; this also cancels a deferred release */
+    e->release_at = 0;
+    e->ref_pending = 1;
+    if (sync_entry_locked(e) < 0) {
+        int err = errno;
+        e->ref_pending = 0;
+        pthread_mutex_unlock(&e->lock);
+        return err;
+    }
+    e->ref_pending = 0;
+    __sync_lock_test_and_set(&e->refs, 1);
+    pthread_mutex_unlock(&e->lock);
+    return 0;
+}
+
+int
+release_wake_lock_ref(const char* id)
+{
+    struct wake_lock_entry *e;
+    int refs;
+    int ret = 0;
+
+    initialize_fds();
+
+    if (g_error) return g_error;
+
+    e = find_entry(id, 0);
+    if (e == NULL)
+        return EINVAL;
+    for (;;) {
+        refs = e->refs;
+        if (refs <= 0)
+            return EINVAL;
+        if (refs == 1)
+            break;
+        if (__sync_bool_compare_and_swap(&e->refs, refs, refs - 1)) {
+            __sync_fetch_and_add(&e->info.releases, 1);
+            __sync_fetch_and_add(&e->info.coalesced, 1);
+            return 0;
+        }
+    }
+
+    /* 1->0, taken under the lock so no acquire slips in mid-edge */
+    lock_entry(e);
+    for (;;) {
+        refs = e->refs;
+        if (refs <= 0) {
+            pthread_mutex_unlock(&e->lock);
+            return EINVAL;
+        }
+        if (__sync_bool_compare_and_swap(&e->refs, refs, refs - 1))
+            break;
+    }
+    __sync_fetch_and_add(&e->info.releases, 1);
+    if (refs > 1) {
+        __sync_fetch_and_add(&e->info.coalesced, 1);
+    } else if (!e->plain && e->held && g_release_delay_ms > 0) {
+        defer_release_locked(e);
+    } else if (sync_entry_locked(e) < 0) {
+        ret = errno;
+    }
+    pthread_mutex_unlock(&e->lock);
+    return ret;
+}
+
+int
+acquire_wake_lock_timeout(const char* id, int64_t timeout_ns)
+{
+    struct wake_lock_entry *e;
+    int64_t until;
+    int ret = 0;
+
+    initialize_fds();
+
+    if (g_error) return g_error;
+
+    if (timeout_ns <= 0)
+        return EINVAL;
+    e = find_entry(id, 1);
+    if (e == NULL)
+        return ENOMEM;
+    note_acquire(e);
+
+    lock_entry(e);
+    until = systemTime() + timeout_ns;
+    if (until > e->timed_until)
+        e->timed_until = until;
+    if (sync_entry_locked(e) < 0)
+        ret = errno;
+    pthread_mutex_unlock(&e->lock);
+    return ret;
+}
+
+void
+set_wake_lock_release_delay(int delay_ms)
+{
+    g_release_delay_ms = delay_ms > 0 ? delay_ms : 0;
+}
+
+/* Called with the entry's lock held */
+static void
+snapshot_entry_locked(struct wake_lock_entry *e, int64_t now, struct wake_lock_info *info)
+{
+    *info = e->info;
+    info->refs = e->refs;
+    info->held = e->held && (e->held_until == 0 || e->held_until > now);
+    if (e->held) {
+        /* count the current hold up to now, or to when the kernel ended it */
+        int64_t end = info->held ? now : e->held_until;
+        uint64_t held_ns = end > e->held_since ? end - e->held_since : 0;
+
+        info->total_held_ns += held_ns;
+        if (held_ns > info->max_held_ns)
+            info->max_held_ns = held_ns;
+    }
+}
+
+int
+get_wake_lock_info(const char* id, struct wake_lock_info *info)
+{
+    struct wake_lock_entry *e;
+
+    e = find_entry(id, 0);
+    if (e == NULL)
+        return -1;
+    pthread_mutex_lock(&e->lock);
+    snapshot_entry_locked(e, systemTime(), info);
+    pthread_mutex_unlock(&e->lock);
+    return 0;
+}
+
+int
+get_wake_lock_stats(struct wake_lock_stat *stats, int max)
+{
+    int64_t now = systemTime();
+    int i, n = 0;
+
+    pthread_once(&g_entries_initialized, init_entries_once);
+    for (i = 0; i < WAKE_LOCK_TABLE_SIZE && n < max; i++) {
+        struct wake_lock_entry *e = &g_entries[i];
+
+        if (e->id == NULL)
+            continue;
+        snprintf(stats[n].id, sizeof(stats[n].id), "%s", e->id);
+        pthread_mutex_lock(&e->lock);
+        snapshot_entry_locked(e, now, &stats[n].info);
+        pthread_mutex_unlock(&e->lock);
+        n++;
+    }
+    return n;
+}
+
+int
+dump_wake_locks(char *buf, size_t len)
+{
+    struct wake_lock_stat stat;
+    int64_t now = systemTime();
+    char last[32];
+    size_t off = 0;
+    int i, n;
+
+    if (len == 0)
+        return 0;
+    buf[0] = '\0';
+    pthread_once(&g_entries_initialized, init_entries_once);
+    for (i = 0; i < WAKE_LOCK_TABLE_SIZE && off < len; i++) {
+        struct wake_lock_entry *e = &g_entries[i];
+
+        if (e->id == NULL)
+            continue;
+        pthread_mutex_lock(&e->lock);
+        snapshot_entry_locked(e, now, &stat.info);
+        pthread_mutex_unlock(&e->lock);
+        if (stat.info.last_acquire_ns != 0)
+            snprintf(last, sizeof(last), "%lldms ago",
+                     (long long) ((now - stat.info.last_acquire_ns) / 1000000));
+        else
+            strcpy(last, "never");
+        n = snprintf(buf + off, len - off,
+                     "%s: refs=%d held=%d acquires=%u total=%lldms max=%lldms "
+                     "last=%s writes=%u/%u coalesced=%u contended=%u\n",
+                     e->id, stat.info.refs, stat.info.held, stat.info.acquires,
+                     (long long) (stat.info.total_held_ns / 1000000),
+                     (long long) (stat.info.max_held_ns / 1000000),
+                     last, stat.info.acquire_writes, stat.info.release_writes,
+                     stat.info.coalesced, stat.info.contended);
+        if (n < 0)
+            break;
+        off += n;
+    }
+    if (off >= len)
+        off = len - 1;
+    return off;
+}
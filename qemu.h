@@ -68,8 +68,8 @@ extern int  qemu_command_format( char*        buffer,
                                  ... );
 
 /* directly sends a command through the 'hw-control' channel.
- * this will open the channel, send the formatted command, then
- * close the channel automatically.
+ * the channel is opened on first use and kept open; it is reopened
+ * automatically if the connection breaks.
  * returns 0 on success, or -1 on error.
  */
 extern int  qemu_control_command( const char*  fmt, ... );
@@ -78,6 +78,9 @@ extern int  qemu_control_command( const char*  fmt, ... );
  * a user-allocated buffer. returns the length of the answer, or -1
  * in case of error.
  *
+ * this is safe to call from several threads; their questions share the
+ * channel and answers are matched back in order.
+ *
  * 'question' *must* have been formatted through qemu_command_format
  */
 extern int  qemu_control_query( const char*  question, int  questionlen,
@@ -26,7 +26,9 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #define  QEMU_DEBUG  0
 
@@ -278,48 +280,149 @@ qemu_command_format( char*        buffer,
     int      ret;
 
     va_start(args, format);
-    ret = qemu_command_format(buffer, buffer_size, format, args);
+    ret = qemu_command_vformat(buffer, buffer_size, format, args);
     va_end(args);
     return ret;
 }
 
 
+/* The hw-control channel is opened on first use and kept open. Commands
+ * are written under 'ctl_lock'; a query also takes a ticket, and answers
+ * come back in the order the questions were sent, so each query reads
+ * its answer once the ones before it have been read. Several queries can
+ * thus be in flight at once.
+ *
+ * If the stream breaks or an answer can't be parsed, the channel is
+ * dropped, the generation bumped so every query still waiting fails, and
+ * the next request reconnects.
+ *
+ * Each connection is reference counted: the channel holds one reference
+ * and every query reading from it another, so a dropped connection is
+ * only closed once the last reader blocked on it is done.
+ */
+typedef struct {
+    int  fd;
+    int  users;
+} QemuControlConn;
+
+static pthread_mutex_t  ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   ctl_turn = PTHREAD_COND_INITIALIZER;
+static QemuChannel      ctl_channel[1];
+static QemuControlConn* ctl_conn;
+static unsigned         ctl_gen;
+static unsigned         ctl_next_ticket;
+static unsigned         ctl_now_serving;
+
 static int
-qemu_control_fd(void)
+qemu_fd_read_full( int  fd, char*  buff, int  len )
 {
-    static QemuChannel  channel[1];
-    int                 fd;
+    int  done = 0;
 
-    fd = qemu_channel_open( channel, "hw-control", O_RDWR );
-    if (fd < 0) {
-        D("%s: could not open control channel: %s", __FUNCTION__,
-          strerror(errno));
+    while (done < len) {
+        int  ret = qemu_fd_read(fd, buff + done, len - done);
+        if (ret <= 0)
+            return -1;
+        done += ret;
     }
-    return fd;
+    return done;
 }
 
-static int
-qemu_control_send(const char*  cmd, int  len)
+/* call with ctl_lock held */
+static void
+qemu_control_conn_put_locked(QemuControlConn*  conn)
 {
-    int  fd, len2;
+    if (--conn->users == 0) {
+        close(conn->fd);
+        free(conn);
+    }
+}
 
-    if (len < 0) {
-        errno = EINVAL;
-        return -1;
+/* call with ctl_lock held */
+static void
+qemu_control_reset_locked(void)
+{
+    if (ctl_conn != NULL) {
+        qemu_control_conn_put_locked(ctl_conn);
+        ctl_conn = NULL;
     }
+    /* a qemud channel hands out dups of one connection; start over */
+    if (ctl_channel->is_qemud)
+        close(ctl_channel->fd);
+    memset(ctl_channel, 0, sizeof ctl_channel);
+
+    ctl_gen++;
+    ctl_now_serving = ctl_next_ticket;
+    pthread_cond_broadcast(&ctl_turn);
+}
 
-    fd = qemu_control_fd();
-    if (fd < 0)
-        return -1;
+/* call with ctl_lock held */
+static int
+qemu_control_fd_locked(void)
+{
+    if (ctl_conn == NULL) {
+        QemuControlConn*  conn;
+        int               fd;
+
+        fd = qemu_channel_open( ctl_channel, "hw-control", O_RDWR );
+        if (fd < 0) {
+            D("%s: could not open control channel: %s", __FUNCTION__,
+              strerror(errno));
+            /* try the lookup again next time */
+            memset(ctl_channel, 0, sizeof ctl_channel);
+            return -1;
+        }
+        conn = malloc(sizeof *conn);
+        if (conn == NULL) {
+            close(fd);
+            return -1;
+        }
+        conn->fd    = fd;
+        conn->users = 1;
+        ctl_conn    = conn;
+    }
+    return ctl_conn->fd;
+}
+
+/* sends 'cmd', reconnecting once if the channel was dropped.
+ * call with ctl_lock held */
+static int
+qemu_control_send_locked(const char*  cmd, int  len)
+{
+    int  attempt, fd, len2;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        fd = qemu_control_fd_locked();
+        if (fd < 0)
+            return -1;
+
+        len2 = qemu_fd_write(fd, cmd, len);
+        if (len2 == len)
+            return 0;
 
-    len2 = qemu_fd_write(fd, cmd, len);
-    close(fd);
-    if (len2 != len) {
         D("%s: could not send everything %d < %d",
           __FUNCTION__, len2, len);
+        qemu_control_reset_locked();
+        /* a partial write can't be retried without corrupting the stream */
+        if (len2 > 0)
+            break;
+    }
+    return -1;
+}
+
+static int
+qemu_control_send(const char*  cmd, int  len)
+{
+    int  ret;
+
+    if (len < 0) {
+        errno = EINVAL;
         return -1;
     }
-    return 0;
+
+    pthread_mutex_lock(&ctl_lock);
+    ret = qemu_control_send_locked(cmd, len);
+    pthread_mutex_unlock(&ctl_lock);
+    return ret;
 }
 
 
@@ -350,27 +453,41 @@ qemu_control_command( const char*  fmt, ... )
 extern int  qemu_control_query( const char*  question, int  questionlen,
                                 char*        answer,   int  answersize )
 {
-    int   ret, fd, len, result = -1;
-    char  header[5], *end;
+    int               ret, fd, len, result = -1, in_sync = 0;
+    char              header[5], *end;
+    unsigned          ticket, gen;
+    QemuControlConn*  conn;
 
     if (questionlen <= 0) {
         errno = EINVAL;
         return -1;
     }
 
-    fd = qemu_control_fd();
-    if (fd < 0)
+    pthread_mutex_lock(&ctl_lock);
+    if (qemu_control_send_locked(question, questionlen) < 0) {
+        pthread_mutex_unlock(&ctl_lock);
         return -1;
-
-    ret = qemu_fd_write( fd, question, questionlen );
-    if (ret != questionlen) {
-        D("%s: could not write all: %d < %d", __FUNCTION__,
-          ret, questionlen);
-        goto Exit;
     }
+    conn   = ctl_conn;
+    fd     = conn->fd;
+    gen    = ctl_gen;
+    ticket = ctl_next_ticket++;
+    conn->users++;
+
+    /* wait for the answers to earlier questions to be read */
+    while (gen == ctl_gen && ctl_now_serving != ticket)
+        pthread_cond_wait(&ctl_turn, &ctl_lock);
+    if (gen != ctl_gen) {
+        qemu_control_conn_put_locked(conn);
+        pthread_mutex_unlock(&ctl_lock);
+        D("%s: channel was reset", __FUNCTION__);
+        errno = EIO;
+        return -1;
+    }
+    pthread_mutex_unlock(&ctl_lock);
 
     /* read a 4-byte header giving the length of the following content */
-    ret = qemu_fd_read( fd, header, 4 );
+    ret = qemu_fd_read_full( fd, header, 4 );
     if (ret != 4) {
         D("%s: could not read header (%d != 4)",
           __FUNCTION__, ret);
@@ -379,23 +496,50 @@ extern int  qemu_control_query( const char*  question, int  questionlen,
 
     header[4] = 0;
     len = strtol( header, &end,  16 );
-    if ( len < 0 || end == NULL || end != header+4 || len > answersize ) {
+    if ( len < 0 || end == NULL || end != header+4 ) {
         D("%s: could not parse header: '%s'",
           __FUNCTION__, header);
         goto Exit;
     }
 
+    if (len > answersize) {
+        /* skip it to keep the stream in step for the next answer */
+        char  skip[64];
+        int   left = len;
+
+        D("%s: answer too large %d > %d", __FUNCTION__, len, answersize);
+        while (left > 0) {
+            int  n = left < (int)sizeof skip ? left : (int)sizeof skip;
+            if (qemu_fd_read_full( fd, skip, n ) != n)
+                goto Exit;
+            left -= n;
+        }
+        in_sync = 1;
+        goto Exit;
+    }
+
     /* read the answer */
-    ret = qemu_fd_read( fd, answer, len );
+    ret = qemu_fd_read_full( fd, answer, len );
     if (ret != len) {
         D("%s: could not read all of answer %d < %d",
           __FUNCTION__, ret, len);
         goto Exit;
     }
 
-    result = len;
+    result  = len;
+    in_sync = 1;
 
 Exit:
-    close(fd);
+    pthread_mutex_lock(&ctl_lock);
+    if (gen == ctl_gen) {
+        if (in_sync) {
+            ctl_now_serving++;
+            pthread_cond_broadcast(&ctl_turn);
+        } else {
+            qemu_control_reset_locked();
+        }
+    }
+    qemu_control_conn_put_locked(conn);
+    pthread_mutex_unlock(&ctl_lock);
     return result;
 }
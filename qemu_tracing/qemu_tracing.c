@@ -14,8 +14,10 @@
  * limitations under the License.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -36,51 +38,168 @@
 // Allow space in the buffer for the address plus whitespace.
 #define MAX_BUF_SIZE (MAX_SYMBOL_NAME_LENGTH + 20)
 
+static int state_fd = -1;
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static int state_on;            // what the driver was last told
+static int state_outside;       // as last set by qemu_start/stop_tracing()
+static volatile int region_depth;
+
+// Called with state_lock held
+static int write_state_locked(int on)
+{
+    ssize_t len;
+
+    // retried on every call, so a driver that shows up late is found
+    if (state_fd < 0)
+        state_fd = open(SYS_QEMU_TRACE_STATE, O_WRONLY | O_CLOEXEC);
+    if (state_fd < 0)
+        return -1;
+    len = TEMP_FAILURE_RETRY(write(state_fd, on ? "1\n" : "0\n", 2));
+    if (len != 2) {
+        int ret = len < 0 ? errno : EIO;
+
+        // reopen next time in case the driver went away
+        close(state_fd);
+        state_fd = -1;
+        return ret;
+    }
+    state_on = on;
+    return 0;
+}
+
+// Called with state_lock held
+static int set_state_locked(int on)
+{
+    state_outside = on;
+    return write_state_locked(on);
+}
+
 // return 0 on success, or an error if the qemu driver cannot be opened
 int qemu_start_tracing()
 {
-    int fd = open(SYS_QEMU_TRACE_STATE, O_WRONLY);
-    if (fd < 0)
-        return fd;
-    write(fd, "1\n", 2);
-    close(fd);
-    return 0;
+    int ret;
+
+    pthread_mutex_lock(&state_lock);
+    ret = set_state_locked(1);
+    pthread_mutex_unlock(&state_lock);
+    return ret;
 }
 
 int qemu_stop_tracing()
 {
-    int fd = open(SYS_QEMU_TRACE_STATE, O_WRONLY);
-    if (fd < 0)
-        return fd;
-    write(fd, "0\n", 2);
-    close(fd);
-    return 0;
+    int ret;
+
+    pthread_mutex_lock(&state_lock);
+    ret = set_state_locked(0);
+    pthread_mutex_unlock(&state_lock);
+    return ret;
 }
 
-int qemu_add_mapping(unsigned int addr, const char *name)
+// Regions nest: tracing goes on when the outermost one begins, and when
+// it ends goes back to what qemu_start/stop_tracing() last asked for, so
+// only those two edges reach the driver. The edge that takes the lock
+// writes whatever the depth says by then, so racing edges from different
+// threads can't leave the wrong state behind.
+static int sync_region_state()
 {
-    char buf[MAX_BUF_SIZE];
+    int ret = 0;
+    int want;
+
+    pthread_mutex_lock(&state_lock);
+    want = region_depth > 0 ? 1 : state_outside;
+    if (want != state_on)
+        ret = write_state_locked(want);
+    pthread_mutex_unlock(&state_lock);
+    return ret;
+}
+
+int qemu_trace_region_begin()
+{
+    if (__sync_fetch_and_add(&region_depth, 1) > 0)
+        return 0;
+    return sync_region_state();
+}
+
+int qemu_trace_region_end()
+{
+    int depth = __sync_sub_and_fetch(&region_depth, 1);
 
-    if (strlen(name) > MAX_SYMBOL_NAME_LENGTH)
+    if (depth < 0) {
+        __sync_fetch_and_add(&region_depth, 1);
         return EINVAL;
-    int fd = open(SYS_QEMU_TRACE_SYMBOL, O_WRONLY);
-    if (fd < 0)
-        return fd;
-    sprintf(buf, "%x %s\n", addr, name);
-    write(fd, buf, strlen(buf));
-    close(fd);
-    return 0;
+    }
+    if (depth > 0)
+        return 0;
+    return sync_region_state();
 }
 
-int qemu_remove_mapping(unsigned int addr)
+static int symbol_fd = -1;
+static pthread_mutex_t symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Writes 'count' mapping records. If 'names' is NULL they are removals.
+// Each record gets its own write(): the trace driver parses one record
+// per store, and kernfs kernels would join the segments of a writev()
+// into a single store. The fd stays open, so a batch still costs only
+// one open() and one lock.
+static int write_mappings(const unsigned int *addrs, const char * const *names, int count)
 {
     char buf[MAX_BUF_SIZE];
+    int i, ret = 0;
 
-    int fd = open(SYS_QEMU_TRACE_SYMBOL, O_WRONLY);
-    if (fd < 0)
-        return fd;
-    sprintf(buf, "%x\n", addr);
-    write(fd, buf, strlen(buf));
-    close(fd);
-    return 0;
+    for (i = 0; names != NULL && i < count; i++) {
+        if (strlen(names[i]) > MAX_SYMBOL_NAME_LENGTH)
+            return EINVAL;
+    }
+
+    pthread_mutex_lock(&symbol_lock);
+    if (symbol_fd < 0)
+        symbol_fd = open(SYS_QEMU_TRACE_SYMBOL, O_WRONLY | O_CLOEXEC);
+    if (symbol_fd < 0) {
+        pthread_mutex_unlock(&symbol_lock);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        ssize_t len, written;
+
+        if (names)
+            len = sprintf(buf, "%x %s\n", addrs[i], names[i]);
+        else
+            len = sprintf(buf, "%x\n", addrs[i]);
+        written = TEMP_FAILURE_RETRY(write(symbol_fd, buf, len));
+        if (written != len) {
+            // a short store would drop the rest of the record
+            ret = written < 0 ? errno : EIO;
+            // reopen next time in case the driver went away
+            close(symbol_fd);
+            symbol_fd = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&symbol_lock);
+    return ret;
+}
+
+int qemu_add_mappings(const unsigned int *addrs, const char * const *names, int count)
+{
+    if (count < 0 || names == NULL)
+        return EINVAL;
+    return write_mappings(addrs, names, count);
+}
+
+int qemu_remove_mappings(const unsigned int *addrs, int count)
+{
+    if (count < 0)
+        return EINVAL;
+    return write_mappings(addrs, NULL, count);
+}
+
+int qemu_add_mapping(unsigned int addr, const char *name)
+{
+    return write_mappings(&addr, &name, 1);
+}
+
+int qemu_remove_mapping(unsigned int addr)
+{
+    return write_mappings(&addr, NULL, 1);
 }
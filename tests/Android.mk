@@ -0,0 +1,42 @@
+# Copyright 2026 The Android Open Source Project
+
+LOCAL_PATH := $(call my-dir)
+
+# wifi HAL against an in-process supplicant stand-in
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := wifi_supplicant_bench
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := \
+	wifi_supplicant_bench.c \
+	supplicant_stub.c \
+	../wifi/wifi.c
+
+LOCAL_SHARED_LIBRARIES := libcutils liblog libwpa_client libnetutils
+
+include $(BUILD_EXECUTABLE)
+
+# supplicant start/stop and driver load times on a device
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := wifi_startup_bench
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := wifi_startup_bench.c
+
+LOCAL_SHARED_LIBRARIES := libhardware_legacy
+
+include $(BUILD_EXECUTABLE)
+
+# uevent listener cost under a replayed storm, with and without the filter
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := uevent_storm_bench
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_SRC_FILES := uevent_storm_bench.c
+
+LOCAL_SHARED_LIBRARIES := libhardware_legacy
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "cutils/properties.h"
+#include "supplicant_stub.h"
+
+#define STUB_MAX_ATTACHED	8
+#define STUB_MAX_REPLIES	32
+#define STUB_MSG_MAX		4096
+
+struct stub_reply {
+    char *prefix;
+    char *reply;
+};
+
+struct supplicant_stub {
+    int fd;
+    int stop_fd;
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct sockaddr_un attached[STUB_MAX_ATTACHED];
+    socklen_t attached_len[STUB_MAX_ATTACHED];
+    int nattached;
+    struct stub_reply replies[STUB_MAX_REPLIES];
+    int nreplies;
+    volatile int delay_ms;
+    volatile int silent;
+    volatile unsigned commands;
+};
+
+/* Must be called with stub->lock held */
+static int find_attached_locked(struct supplicant_stub *stub,
+                                const struct sockaddr_un *addr, socklen_t len)
+{
+    int i;
+
+    for (i = 0; i < stub->nattached; i++) {
+        if (stub->attached_len[i] == len && memcmp(&stub->attached[i], addr, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Fills 'reply' with the answer to 'cmd'; returns its length */
+static int answer(struct supplicant_stub *stub, const char *cmd,
+                  const struct sockaddr_un *from, socklen_t fromlen, char *reply)
+{
+    int i;
+
+    pthread_mutex_lock(&stub->lock);
+    if (strcmp(cmd, "ATTACH") == 0) {
+        if (find_attached_locked(stub, from, fromlen) < 0) {
+            if (stub->nattached == STUB_MAX_ATTACHED) {
+                pthread_mutex_unlock(&stub->lock);
+                return snprintf(reply, STUB_MSG_MAX, "FAIL\n");
+            }
+            stub->attached[stub->nattached] = *from;
+            stub->attached_len[stub->nattached] = fromlen;
+            stub->nattached++;
+        }
+        pthread_mutex_unlock(&stub->lock);
+        return snprintf(reply, STUB_MSG_MAX, "OK\n");
+    }
+    if (strcmp(cmd, "DETACH") == 0) {
+        i = find_attached_locked(stub, from, fromlen);
+        if (i >= 0) {
+            stub->nattached--;
+            stub->attached[i] = stub->attached[stub->nattached];
+            stub->attached_len[i] = stub->attached_len[stub->nattached];
+        }
+        pthread_mutex_unlock(&stub->lock);
+        return snprintf(reply, STUB_MSG_MAX, "OK\n");
+    }
+    for (i = stub->nreplies - 1; i >= 0; i--) {
+        if (strncmp(cmd, stub->replies[i].prefix, strlen(stub->replies[i].prefix)) == 0) {
+            int len = snprintf(reply, STUB_MSG_MAX, "%s", stub->replies[i].reply);
+            pthread_mutex_unlock(&stub->lock);
+            return len < STUB_MSG_MAX ? len : STUB_MSG_MAX - 1;
+        }
+    }
+    pthread_mutex_unlock(&stub->lock);
+    if (strcmp(cmd, "PING") == 0)
+        return snprintf(reply, STUB_MSG_MAX, "PONG\n");
+    return snprintf(reply, STUB_MSG_MAX, "OK\n");
+}
+
+static void *serve(void *arg)
+{
+    struct supplicant_stub *stub = arg;
+    char cmd[STUB_MSG_MAX], reply[STUB_MSG_MAX];
+    struct pollfd fds[2];
+
+    for (;;) {
+        struct sockaddr_un from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t len;
+        int rlen;
+
+        fds[0].fd = stub->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = stub->stop_fd;
+        fds[1].events = POLLIN;
+        fds[0].revents = fds[1].revents = 0;
+        if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) < 0)
+            break;
+        if (fds[1].revents & POLLIN)
+            break;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        len = TEMP_FAILURE_RETRY(recvfrom(stub->fd, cmd, sizeof(cmd) - 1, 0,
+                                          (struct sockaddr *) &from, &fromlen));
+        if (len < 0)
+            continue;
+        cmd[len] = '\0';
+        __sync_fetch_and_add(&stub->commands, 1);
+        if (stub->silent)
+            continue;
+
+        rlen = answer(stub, cmd, &from, fromlen, reply);
+        if (stub->delay_ms > 0)
+            usleep(stub->delay_ms * 1000);
+        TEMP_FAILURE_RETRY(sendto(stub->fd, reply, rlen, 0,
+                                  (struct sockaddr *) &from, fromlen));
+    }
+    return NULL;
+}
+
+struct supplicant_stub *supplicant_stub_start(const char *path)
+{
+    struct supplicant_stub *stub;
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    stub = calloc(1, sizeof(*stub));
+    if (stub == NULL)
+        return NULL;
+    pthread_mutex_init(&stub->lock, NULL);
+    strcpy(stub->path, path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    stub->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    stub->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stub->fd < 0 || stub->stop_fd < 0
+            || bind(stub->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || pthread_create(&stub->thread, NULL, serve, stub) != 0) {
+        int err = errno;
+
+        if (stub->fd >= 0)
+            close(stub->fd);
+        if (stub->stop_fd >= 0)
+            close(stub->stop_fd);
+        unlink(path);
+        free(stub);
+        errno = err;
+        return NULL;
+    }
+    return stub;
+}
+
+void supplicant_stub_stop(struct supplicant_stub *stub)
+{
+    uint64_t one = 1;
+    int i;
+
+    if (TEMP_FAILURE_RETRY(write(stub->stop_fd, &one, sizeof(one))) == sizeof(one))
+        pthread_join(stub->thread, NULL);
+    close(stub->fd);
+    close(stub->stop_fd);
+    unlink(stub->path);
+    for (i = 0; i < stub->nreplies; i++) {
+        free(stub->replies[i].prefix);
+        free(stub->replies[i].reply);
+    }
+    pthread_mutex_destroy(&stub->lock);
+    free(stub);
+}
+
+int supplicant_stub_set_reply(struct supplicant_stub *stub, const char *prefix,
+                              const char *reply)
+{
+    struct stub_reply *r;
+
+    pthread_mutex_lock(&stub->lock);
+    if (stub->nreplies == STUB_MAX_REPLIES) {
+        pthread_mutex_unlock(&stub->lock);
+        return -1;
+    }
+    r = &stub->replies[stub->nreplies];
+    r->prefix = strdup(prefix);
+    r->reply = strdup(reply);
+    if (r->prefix == NULL || r->reply == NULL) {
+        free(r->prefix);
+        free(r->reply);
+        pthread_mutex_unlock(&stub->lock);
+        return -1;
+    }
+    stub->nreplies++;
+    pthread_mutex_unlock(&stub->lock);
+    return 0;
+}
+
+void supplicant_stub_set_delay(struct supplicant_stub *stub, int delay_ms)
+{
+    stub->delay_ms = delay_ms;
+}
+
+void supplicant_stub_set_silent(struct supplicant_stub *stub, int silent)
+{
+    stub->silent = silent;
+}
+
+/*
+ * Unlike the supplicant, which drops events for a monitor whose queue is
+ * full, the sends below block, so a storm of 'count' events is delivered
+ * in full and the receiver's rate can be measured.
+ */
+int supplicant_stub_send_events(struct supplicant_stub *stub, const char *event,
+                                int count)
+{
+    struct sockaddr_un to[STUB_MAX_ATTACHED];
+    socklen_t tolen[STUB_MAX_ATTACHED];
+    char msg[STUB_MSG_MAX];
+    int i, n, len, sent = 0;
+
+    len = snprintf(msg, sizeof(msg), "<2>%s", event);
+    if (len >= (int) sizeof(msg))
+        return -1;
+
+    pthread_mutex_lock(&stub->lock);
+    n = stub->nattached;
+    memcpy(to, stub->attached, n * sizeof(to[0]));
+    memcpy(tolen, stub->attached_len, n * sizeof(tolen[0]));
+    pthread_mutex_unlock(&stub->lock);
+
+    while (count-- > 0) {
+        for (i = 0; i < n; i++) {
+            if (TEMP_FAILURE_RETRY(sendto(stub->fd, msg, len, 0,
+                                          (struct sockaddr *) &to[i], tolen[i])) == len)
+                sent++;
+        }
+    }
+    return sent;
+}
+
+unsigned supplicant_stub_commands(struct supplicant_stub *stub)
+{
+    return stub->commands;
+}
+
+int supplicant_stub_attached(struct supplicant_stub *stub)
+{
+    int n;
+
+    pthread_mutex_lock(&stub->lock);
+    n = stub->nattached;
+    pthread_mutex_unlock(&stub->lock);
+    return n;
+}
+
+/*
+ * In-process stand-in for the property service. wifi_start_supplicant()
+ * treats the service as already running when the property named after it
+ * reads "running", so it only selects the supplicant and returns.
+ */
+#define STUB_MAX_PROPS	32
+
+static struct {
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+} stub_props[STUB_MAX_PROPS] = {
+    { "wpa_supplicant", "running" },
+    { "init.svc.wpa_supplicant", "running" },
+    { "p2p_supplicant", "running" },
+    { "init.svc.p2p_supplicant", "running" },
+    { "wifi.interface", "wlan0" },
+};
+static pthread_mutex_t stub_props_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int property_get(const char *key, char *value, const char *default_value)
+{
+    int i, len = 0;
+
+    pthread_mutex_lock(&stub_props_lock);
+    for (i = 0; i < STUB_MAX_PROPS && stub_props[i].key[0]; i++) {
+        if (strcmp(stub_props[i].key, key) == 0) {
+            strcpy(value, stub_props[i].value);
+            pthread_mutex_unlock(&stub_props_lock);
+            return strlen(value);
+        }
+    }
+    pthread_mutex_unlock(&stub_props_lock);
+    if (default_value != NULL) {
+        len = strlen(default_value);
+        if (len >= PROPERTY_VALUE_MAX)
+            len = PROPERTY_VALUE_MAX - 1;
+        memcpy(value, default_value, len);
+    }
+    value[len] = '\0';
+    return len;
+}
+
+int property_set(const char *key, const char *value)
+{
+    int i;
+
+    if (strlen(key) >= PROPERTY_KEY_MAX || strlen(value) >= PROPERTY_VALUE_MAX)
+        return -1;
+    pthread_mutex_lock(&stub_props_lock);
+    for (i = 0; i < STUB_MAX_PROPS && stub_props[i].key[0]; i++) {
+        if (strcmp(stub_props[i].key, key) == 0)
+            break;
+    }
+    if (i == STUB_MAX_PROPS) {
+        pthread_mutex_unlock(&stub_props_lock);
+        return -1;
+    }
+    strcpy(stub_props[i].key, key);
+    strcpy(stub_props[i].value, value);
+    pthread_mutex_unlock(&stub_props_lock);
+    return 0;
+}
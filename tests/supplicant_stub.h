@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SUPPLICANT_STUB_H
+#define _SUPPLICANT_STUB_H
+
+/*
+ * A stand-in for wpa_supplicant's control interface: a UNIX datagram
+ * socket that answers commands from a script and sends events to the
+ * connections that sent ATTACH, so the wifi HAL's command and event paths
+ * can be driven without a supplicant or a Wi-Fi device.
+ *
+ * Linking supplicant_stub.c also replaces property_get()/property_set()
+ * with an in-process store, so the HAL sees the supplicant as running.
+ */
+
+#if __cplusplus
+extern "C" {
+#endif
+
+struct supplicant_stub;
+
+/* Serves the control interface on 'path'; NULL on error */
+struct supplicant_stub *supplicant_stub_start(const char *path);
+
+/* Stops serving and removes the socket */
+void supplicant_stub_stop(struct supplicant_stub *stub);
+
+/*
+ * Answers commands starting with 'prefix' with 'reply' (the most recently
+ * added match wins). PING gets "PONG\n" and anything else "OK\n" unless
+ * scripted.
+ */
+int supplicant_stub_set_reply(struct supplicant_stub *stub, const char *prefix,
+                              const char *reply);
+
+/* Delays every reply by 'delay_ms' */
+void supplicant_stub_set_delay(struct supplicant_stub *stub, int delay_ms);
+
+/* While set, commands are read but never answered, so requests time out */
+void supplicant_stub_set_silent(struct supplicant_stub *stub, int silent);
+
+/*
+ * Sends 'event' (e.g. "CTRL-EVENT-SCAN-RESULTS ") at message level 2 to
+ * every attached connection, 'count' times back to back. Returns the
+ * number of datagrams sent.
+ */
+int supplicant_stub_send_events(struct supplicant_stub *stub, const char *event,
+                                int count);
+
+/* Commands received so far */
+unsigned supplicant_stub_commands(struct supplicant_stub *stub);
+
+/* Connections currently attached */
+int supplicant_stub_attached(struct supplicant_stub *stub);
+
+#if __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // _SUPPLICANT_STUB_H
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays a uevent storm into the uevent socket and reports how long the
+ * listener takes to drain it and how much CPU its thread uses, without and
+ * then with the kernel-side filter from uevent_set_filter().
+ *
+ *   uevent_storm_bench [-n events] [-r relevant_every]
+ *
+ * The events are unicast to the listener's own socket, so ueventd and
+ * other listeners never see them. One in 'relevant_every' is a
+ * power_supply event, which the filter lets through; the rest are block
+ * and net events, which it drops.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "hardware_legacy/uevent.h"
+
+#define STORM_MSG_MAX	1024
+#define STORM_END_PATH	"/devices/virtual/switch/storm_bench_end"
+
+static int nevents = 100000;
+static int relevant_every = 10;
+
+static int64_t now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t thread_cpu_us()
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_THREAD, &ru) < 0)
+        return 0;
+    return (int64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* Formats a uevent the way the kernel does; returns its length */
+static int format_event(char *buf, const char *action, const char *devpath,
+                        const char *subsystem, int seqnum)
+{
+    int len;
+
+    len = snprintf(buf, STORM_MSG_MAX, "%s@%s", action, devpath) + 1;
+    len += snprintf(buf + len, STORM_MSG_MAX - len, "ACTION=%s", action) + 1;
+    len += snprintf(buf + len, STORM_MSG_MAX - len, "DEVPATH=%s", devpath) + 1;
+    len += snprintf(buf + len, STORM_MSG_MAX - len, "SUBSYSTEM=%s", subsystem) + 1;
+    len += snprintf(buf + len, STORM_MSG_MAX - len, "SEQNUM=%d", seqnum) + 1;
+    return len;
+}
+
+static void *storm_thread(void *arg)
+{
+    struct sockaddr_nl to;
+    char buf[STORM_MSG_MAX];
+    int s, i, len;
+
+    (void) arg;
+    s = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (s < 0) {
+        perror("socket");
+        return NULL;
+    }
+    memset(&to, 0, sizeof(to));
+    to.nl_family = AF_NETLINK;
+    to.nl_pid = getpid();    /* the port uevent_init() binds */
+
+    /* a unicast send blocks while the listener's queue is full */
+    for (i = 0; i < nevents; i++) {
+        if (i % relevant_every == 0)
+            len = format_event(buf, "change", "/devices/platform/battery/power_supply/battery",
+                               "power_supply", i);
+        else if (i & 1)
+            len = format_event(buf, "change", "/devices/virtual/block/loop7", "block", i);
+        else
+            len = format_event(buf, "change", "/devices/virtual/net/rmnet_data3", "net", i);
+        sendto(s, buf, len, 0, (struct sockaddr *) &to, sizeof(to));
+    }
+    len = format_event(buf, "change", STORM_END_PATH, "switch", i);
+    sendto(s, buf, len, 0, (struct sockaddr *) &to, sizeof(to));
+    close(s);
+    return NULL;
+}
+
+static int run(const char *name)
+{
+    char buf[STORM_MSG_MAX];
+    pthread_t thread;
+    int64_t start, cpu;
+    int received = 0, len;
+
+    if (pthread_create(&thread, NULL, storm_thread, NULL) != 0)
+        return -1;
+    start = now_us();
+    cpu = thread_cpu_us();
+    for (;;) {
+        len = uevent_next_event(buf, sizeof(buf) - 1);
+        buf[len] = '\0';
+        if (strcmp(buf, "change@" STORM_END_PATH) == 0)
+            break;
+        received++;
+    }
+    cpu = thread_cpu_us() - cpu;
+    start = now_us() - start;
+    pthread_join(thread, NULL);
+    printf("%-10s %d of %d events received in %lld us, listener cpu %lld us\n", name,
+           received, nevents, (long long) start, (long long) cpu);
+    return received;
+}
+
+int main(int argc, char **argv)
+{
+    static const char * const subsystems[] = { "power_supply", "switch", NULL };
+    int expected, c;
+
+    while ((c = getopt(argc, argv, "n:r:")) != -1) {
+        switch (c) {
+        case 'n':
+            nevents = atoi(optarg);
+            break;
+        case 'r':
+            relevant_every = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n events] [-r relevant_every]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (nevents <= 0 || relevant_every <= 0)
+        return 2;
+
+    if (!uevent_init()) {
+        perror("uevent_init");
+        return 1;
+    }
+
+    if (run("unfiltered") != nevents)
+        return 1;
+    if (uevent_set_filter(subsystems, NULL) < 0) {
+        perror("uevent_set_filter");
+        return 1;
+    }
+    expected = (nevents + relevant_every - 1) / relevant_every;
+    return run("filtered") == expected ? 0 : 1;
+}
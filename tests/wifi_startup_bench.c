@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Times Wi-Fi bring-up steps on a device, for comparing builds of
+ * libhardware_legacy. Runs as root with the framework's Wi-Fi turned off:
+ *
+ *   wifi_startup_bench [-n iterations] [-p] [-d]
+ *
+ * Each iteration starts the supplicant, waits until it reports running,
+ * then stops it and waits until it reports stopped. -p starts the p2p
+ * supplicant instead. -d times wifi_load_driver()/wifi_unload_driver()
+ * instead, and reports the peak RSS of the process, which includes
+ * whatever insmod() had to map or copy. Prints min/median/max per step.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "hardware_legacy/wifi.h"
+
+static int64_t now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_us(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *step, int64_t *samples, int n)
+{
+    if (n == 0) {
+        printf("%-8s no samples\n", step);
+        return;
+    }
+    qsort(samples, n, sizeof(samples[0]), cmp_us);
+    printf("%-8s n=%d min %lld us, median %lld us, max %lld us\n", step, n,
+           (long long) samples[0], (long long) samples[n / 2],
+           (long long) samples[n - 1]);
+}
+
+static int bench_driver(int iterations, int64_t *load_us, int64_t *unload_us)
+{
+    struct rusage ru;
+    int64_t t;
+    int i, nload = 0, nunload = 0, failed = 0;
+
+    for (i = 0; i < iterations; i++) {
+        t = now_us();
+        if (wifi_load_driver() < 0) {
+            printf("iteration %d: load failed\n", i);
+            failed = 1;
+            continue;
+        }
+        load_us[nload++] = now_us() - t;
+
+        t = now_us();
+        if (wifi_unload_driver() < 0) {
+            printf("iteration %d: unload failed\n", i);
+            failed = 1;
+            break;
+        }
+        unload_us[nunload++] = now_us() - t;
+    }
+
+    report("load", load_us, nload);
+    report("unload", unload_us, nunload);
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        printf("peak rss %ld kB\n", ru.ru_maxrss);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    int64_t *start_us, *stop_us, t;
+    int iterations = 20;
+    int p2p = 0, driver = 0;
+    int i, c, nstart = 0, nstop = 0, failed = 0;
+
+    while ((c = getopt(argc, argv, "n:pd")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'p':
+            p2p = 1;
+            break;
+        case 'd':
+            driver = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-p] [-d]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations <= 0)
+        return 2;
+
+    start_us = calloc(iterations, sizeof(int64_t));
+    stop_us = calloc(iterations, sizeof(int64_t));
+    if (start_us == NULL || stop_us == NULL)
+        return 1;
+
+    if (driver) {
+        failed = bench_driver(iterations, start_us, stop_us);
+        free(start_us);
+        free(stop_us);
+        return failed ? 1 : 0;
+    }
+
+    if (wifi_load_driver() < 0) {
+        fprintf(stderr, "cannot load the Wi-Fi driver\n");
+        return 1;
+    }
+    for (i = 0; i < iterations; i++) {
+        t = now_us();
+        if (wifi_start_supplicant(p2p) < 0) {
+            printf("iteration %d: start failed\n", i);
+            failed = 1;
+            continue;
+        }
+        start_us[nstart++] = now_us() - t;
+
+        t = now_us();
+        if (wifi_stop_supplicant(p2p) < 0) {
+            printf("iteration %d: stop failed\n", i);
+            failed = 1;
+            continue;
+        }
+        stop_us[nstop++] = now_us() - t;
+    }
+    wifi_unload_driver();
+
+    report("start", start_us, nstart);
+    report("stop", stop_us, nstop);
+    free(start_us);
+    free(stop_us);
+    return failed ? 1 : 0;
+}
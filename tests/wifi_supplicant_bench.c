@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmarks the wifi HAL's supplicant paths against supplicant_stub:
+ * command throughput, event delivery rate, command timeouts and
+ * cancellation of a blocked wifi_wait_for_event().
+ *
+ *   wifi_supplicant_bench [-s socket_path] [-n commands] [-e events] [-t]
+ *
+ * -t also runs the timeout case, which waits out wpa_ctrl's 10 s request
+ * timeout. Exits non-zero if any case misbehaves.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "hardware_legacy/wifi.h"
+#include "supplicant_stub.h"
+
+/* exported by wifi.c but not declared in wifi.h */
+extern int wifi_connect_on_socket_path(const char *path);
+extern void wifi_close_sockets();
+
+#define BENCH_THREADS	4
+#define EVENT_BUF_SIZE	256
+
+static const char *socket_path = "/data/local/tmp/wifi_bench_ctrl";
+static int ncommands = 20000;
+static int nevents = 20000;
+
+static int64_t now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int ping(int n)
+{
+    char reply[64];
+    size_t len;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        len = sizeof(reply) - 1;
+        if (wifi_command("PING", reply, &len) != 0 || strcmp(reply, "PONG\n") != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void *ping_thread(void *arg)
+{
+    return (void *) (long) ping((long) arg);
+}
+
+static int bench_commands()
+{
+    pthread_t threads[BENCH_THREADS];
+    int64_t start, elapsed;
+    int i, ret = 0;
+
+    start = now_us();
+    if (ping(ncommands) < 0) {
+        printf("commands: PING failed\n");
+        return -1;
+    }
+    elapsed = now_us() - start;
+    printf("commands: 1 thread, %d PINGs in %lld us (%.0f/s)\n", ncommands,
+           (long long) elapsed, ncommands * 1e6 / elapsed);
+
+    start = now_us();
+    for (i = 0; i < BENCH_THREADS; i++)
+        pthread_create(&threads[i], NULL, ping_thread, (void *) (long) (ncommands / BENCH_THREADS));
+    for (i = 0; i < BENCH_THREADS; i++) {
+        void *res;
+        pthread_join(threads[i], &res);
+        if (res != NULL)
+            ret = -1;
+    }
+    elapsed = now_us() - start;
+    printf("commands: %d threads, %d PINGs in %lld us (%.0f/s)%s\n", BENCH_THREADS,
+           ncommands / BENCH_THREADS * BENCH_THREADS, (long long) elapsed,
+           ncommands / BENCH_THREADS * BENCH_THREADS * 1e6 / elapsed,
+           ret < 0 ? ", FAILED" : "");
+    return ret;
+}
+
+struct event_waiter {
+    int want;
+    int got;
+    int terminated;
+    int64_t done_us;
+};
+
+static void *event_thread(void *arg)
+{
+    struct event_waiter *w = arg;
+    char buf[EVENT_BUF_SIZE];
+
+    while (w->got < w->want) {
+        if (wifi_wait_for_event(buf, sizeof(buf)) <= 0)
+            break;
+        if (strncmp(buf, "CTRL-EVENT-TERMINATING", 22) == 0) {
+            w->terminated = 1;
+            break;
+        }
+        w->got++;
+    }
+    w->done_us = now_us();
+    return NULL;
+}
+
+static int bench_events(struct supplicant_stub *stub)
+{
+    struct event_waiter w;
+    pthread_t thread;
+    int64_t start;
+    int sent;
+
+    memset(&w, 0, sizeof(w));
+    w.want = nevents;
+    pthread_create(&thread, NULL, event_thread, &w);
+    start = now_us();
+    sent = supplicant_stub_send_events(stub, "CTRL-EVENT-SCAN-RESULTS ", nevents);
+    pthread_join(thread, NULL);
+    printf("events: %d sent, %d received in %lld us (%.0f/s)\n", sent, w.got,
+           (long long) (w.done_us - start), w.got * 1e6 / (w.done_us - start));
+    return w.got == nevents ? 0 : -1;
+}
+
+static int bench_delayed_commands(struct supplicant_stub *stub)
+{
+    int64_t start, elapsed;
+    int n = 20;
+
+    supplicant_stub_set_delay(stub, 5);
+    start = now_us();
+    if (ping(n) < 0) {
+        supplicant_stub_set_delay(stub, 0);
+        printf("delayed commands: PING failed\n");
+        return -1;
+    }
+    elapsed = now_us() - start;
+    supplicant_stub_set_delay(stub, 0);
+    printf("delayed commands: %d PINGs with 5 ms replies, %lld us per command\n", n,
+           (long long) (elapsed / n));
+    return 0;
+}
+
+/* A timed out command must return -2 and release a blocked event waiter */
+static int bench_timeout(struct supplicant_stub *stub)
+{
+    struct event_waiter w;
+    pthread_t thread;
+    char reply[64];
+    size_t len = sizeof(reply) - 1;
+    int64_t start;
+    int ret;
+
+    memset(&w, 0, sizeof(w));
+    w.want = 1;
+    pthread_create(&thread, NULL, event_thread, &w);
+    supplicant_stub_set_silent(stub, 1);
+    start = now_us();
+    ret = wifi_command("PING", reply, &len);
+    printf("timeout: command returned %d after %lld ms\n", ret,
+           (long long) ((now_us() - start) / 1000));
+    supplicant_stub_set_silent(stub, 0);
+    pthread_join(thread, NULL);
+    printf("timeout: event waiter %s\n", w.terminated ? "released" : "NOT released");
+    return ret == -2 && w.terminated ? 0 : -1;
+}
+
+/* wifi_close_sockets() must release a blocked event waiter promptly */
+static int bench_cancel()
+{
+    struct event_waiter w;
+    pthread_t thread;
+    int64_t start;
+
+    memset(&w, 0, sizeof(w));
+    w.want = 1;
+    pthread_create(&thread, NULL, event_thread, &w);
+    usleep(100000);    /* let it block */
+    start = now_us();
+    wifi_close_sockets();
+    pthread_join(thread, NULL);
+    printf("cancel: event waiter %s after %lld us\n",
+           w.terminated ? "released" : "NOT released", (long long) (w.done_us - start));
+    return w.terminated ? 0 : -1;
+}
+
+static int connect_stub()
+{
+    int i;
+
+    /* selects the supplicant; the stand-in properties say it is running */
+    if (wifi_start_supplicant(0) < 0)
+        return -1;
+    for (i = 0; i < 50; i++) {
+        if (wifi_connect_on_socket_path(socket_path) == 0)
+            return 0;
+        usleep(10000);
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    struct supplicant_stub *stub;
+    int timeout = 0;
+    int failed = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:n:e:t")) != -1) {
+        switch (c) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'n':
+            ncommands = atoi(optarg);
+            break;
+        case 'e':
+            nevents = atoi(optarg);
+            break;
+        case 't':
+            timeout = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s socket_path] [-n commands] [-e events] [-t]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    stub = supplicant_stub_start(socket_path);
+    if (stub == NULL) {
+        perror("supplicant_stub_start");
+        return 1;
+    }
+    if (connect_stub() < 0) {
+        fprintf(stderr, "cannot connect to %s\n", socket_path);
+        supplicant_stub_stop(stub);
+        return 1;
+    }
+
+    failed |= bench_commands();
+    failed |= bench_delayed_commands(stub);
+    failed |= bench_events(stub);
+    if (timeout) {
+        failed |= bench_timeout(stub);
+        /* a timeout tears the monitor down; start over */
+        wifi_close_sockets();
+        if (connect_stub() < 0)
+            failed = 1;
+    }
+    failed |= bench_cancel();
+
+    supplicant_stub_stop(stub);
+    return failed ? 1 : 0;
+}
@@ -16,28 +16,129 @@
 
 #include <hardware_legacy/uevent.h>
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
 #include <unistd.h>
 #include <poll.h>
 #include <pthread.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
-#include <sys/queue.h>
 #include <linux/netlink.h>
+#include <linux/filter.h>
 
+#define LOG_TAG "uevent"
+#include <cutils/log.h>
 
-LIST_HEAD(uevent_handler_head, uevent_handler) uevent_handler_list;
+
+/* Serializes handler registration; dispatch doesn't take it */
 pthread_mutex_t uevent_handler_list_lock = PTHREAD_MUTEX_INITIALIZER;
 
 struct uevent_handler {
     void (*handler)(void *data, const char *msg, int msg_len);
     void *handler_data;
-    LIST_ENTRY(uevent_handler) list;
 };
 
+struct uevent_filtered_handler {
+    void (*handler)(void *data, const struct uevent *event);
+    void *handler_data;
+    char *subsystem;
+    char *action;
+    char *devpath_prefix;
+    size_t devpath_prefix_len;
+};
+
+/*
+ * The registered handlers, as an immutable snapshot. Registration builds
+ * a new set and publishes it; dispatch reads whichever set is current
+ * without locking. A replaced set is retired and freed once no dispatch
+ * is running, along with a filtered handler removed when it was replaced.
+ */
+struct handler_set {
+    int num_handlers;
+    struct uevent_handler *handlers;
+    int num_filtered;
+    struct uevent_filtered_handler **filtered;
+    struct uevent_filtered_handler *dropped;
+    struct handler_set *next_retired;
+};
+
+static struct handler_set *volatile current_set;
+static struct handler_set *retired_sets;
+static volatile int active_readers;
+
 static int fd = -1;
 
+/*
+ * Splits the "action@devpath" header and the KEY=value strings that follow
+ * it. Pointers refer into 'msg', which must stay valid while 'ev' is used.
+ */
+static void parse_uevent(const char *msg, int len, struct uevent *ev)
+{
+    const char *end = msg + len;
+    const char *p = msg;
+
+    memset(ev, 0, sizeof(*ev));
+    ev->msg = msg;
+    ev->msg_len = len;
+    while (p < end) {
+        const char *nul = memchr(p, '\0', end - p);
+        const char *eq;
+
+        if (nul == NULL)
+            break;
+        if (p == msg) {
+            /* the header repeats ACTION and DEVPATH, which follow anyway */
+        } else if ((eq = memchr(p, '=', nul - p)) != NULL &&
+                ev->num_keys < UEVENT_MAX_KEYS) {
+            struct uevent_key *k = &ev->keys[ev->num_keys++];
+
+            k->key = p;
+            k->key_len = eq - p;
+            k->value = eq + 1;
+            if (k->key_len == 6 && memcmp(p, "ACTION", 6) == 0)
+                ev->action = k->value;
+            else if (k->key_len == 7 && memcmp(p, "DEVPATH", 7) == 0)
+                ev->devpath = k->value;
+            else if (k->key_len == 9 && memcmp(p, "SUBSYSTEM", 9) == 0)
+                ev->subsystem = k->value;
+        }
+        p = nul + 1;
+    }
+}
+
+static int filter_matches(const struct uevent_filtered_handler *h, const struct uevent *ev)
+{
+    if (h->subsystem && (ev->subsystem == NULL || strcmp(h->subsystem, ev->subsystem)))
+        return 0;
+    if (h->action && (ev->action == NULL || strcmp(h->action, ev->action)))
+        return 0;
+    if (h->devpath_prefix && (ev->devpath == NULL ||
+            strncmp(h->devpath_prefix, ev->devpath, h->devpath_prefix_len)))
+        return 0;
+    return 1;
+}
+
+const char *uevent_get_value(const struct uevent *event, const char *key)
+{
+    size_t len = strlen(key);
+    int i;
+
+    for (i = 0; i < event->num_keys; i++) {
+        if (event->keys[i].key_len == len && memcmp(event->keys[i].key, key, len) == 0)
+            return event->keys[i].value;
+    }
+    return NULL;
+}
+
 /* Returns 0 on failure, 1 on success */
 int uevent_init()
 {
@@ -70,6 +171,316 @@ int uevent_get_fd()
     return fd;
 }
 
+/*
+ * The kernel formats a uevent as "action@devpath\0ACTION=action\0
+ * DEVPATH=devpath\0SUBSYSTEM=...", so once the header's NUL is found at L
+ * the SUBSYSTEM key starts at 2L + 17. The filter checks the key is really
+ * there and lets anything it can't make sense of through, leaving the rest
+ * to userspace. A load past the end of the packet would end the program
+ * and drop the packet, so every load is bounds-checked against the packet
+ * length first.
+ */
+#define FILTER_SCAN_MAX     256     /* longest header the filter looks for */
+#define FILTER_SCAN_SEG     64
+#define FILTER_STR_MAX      64
+
+struct filter_prog {
+    struct sock_filter *insns;
+    int len;
+    int cap;
+};
+
+static void emit(struct filter_prog *p, unsigned short code, unsigned char jt,
+                 unsigned char jf, unsigned int k)
+{
+    if (p->len < p->cap) {
+        p->insns[p->len].code = code;
+        p->insns[p->len].jt = jt;
+        p->insns[p->len].jf = jf;
+        p->insns[p->len].k = k;
+    }
+    p->len++;
+}
+
+/*
+ * Emits a compare of 'len' bytes of 'str' at packet offset 'off' (from X if
+ * 'ind', which must not be past the end of the packet), followed by a jump
+ * to 'match'. A mismatch, or a packet too short to hold 'str', falls through
+ * past it.
+ */
+static void emit_match(struct filter_prog *p, int ind, int off, const char *str,
+                       int len, int match)
+{
+    unsigned short mode = ind ? BPF_IND : BPF_ABS;
+    int nloads = 0, i, left;
+
+    for (i = 0; i < len; i += left >= 4 ? 4 : left >= 2 ? 2 : 1) {
+        left = len - i;
+        nloads++;
+    }
+    emit(p, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+    if (ind)
+        emit(p, BPF_ALU | BPF_SUB | BPF_X, 0, 0, 0);
+    emit(p, BPF_JMP | BPF_JGE | BPF_K, 0, 2 * nloads + 1, off + len);
+    for (i = 0; i < len; nloads--) {
+        unsigned int v;
+        left = len - i;
+        if (left >= 4) {
+            v = ((unsigned char) str[i] << 24) | ((unsigned char) str[i + 1] << 16) |
+                ((unsigned char) str[i + 2] << 8) | (unsigned char) str[i + 3];
+            emit(p, BPF_LD | BPF_W | mode, 0, 0, off + i);
+            i += 4;
+        } else if (left >= 2) {
+            v = ((unsigned char) str[i] << 8) | (unsigned char) str[i + 1];
+            emit(p, BPF_LD | BPF_H | mode, 0, 0, off + i);
+            i += 2;
+        } else {
+            v = (unsigned char) str[i];
+            emit(p, BPF_LD | BPF_B | mode, 0, 0, off + i);
+            i += 1;
+        }
+        emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 2 * (nloads - 1) + 1, v);
+    }
+    emit(p, BPF_JMP | BPF_JA, 0, 0, match - p->len - 1);
+}
+
+static int build_filter(struct filter_prog *p, const char * const *subsystems,
+                        const char * const *actions)
+{
+    char str[FILTER_STR_MAX + 2];
+    int accept, reject, found, after_action;
+    int pass, base;
+    int i, n;
+
+    /* The first pass sizes the program and finds the labels */
+    accept = reject = found = after_action = 0;
+    for (pass = 0; pass < 2; pass++) {
+        p->len = 0;
+
+        /* too short to make sense of */
+        emit(p, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+        emit(p, BPF_JMP | BPF_JGE | BPF_K, 1, 0, 4);
+        emit(p, BPF_JMP | BPF_JA, 0, 0, accept - p->len - 1);
+
+        /* libudev messages have another layout; let them through */
+        emit(p, BPF_LD | BPF_W | BPF_ABS, 0, 0, 0);
+        emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0x6c696275);    /* "libu" */
+        emit(p, BPF_JMP | BPF_JA, 0, 0, accept - p->len - 1);
+
+        if (actions != NULL) {
+            for (i = 0; actions[i] != NULL; i++) {
+                n = snprintf(str, sizeof(str), "%s@", actions[i]);
+                emit_match(p, 0, 0, str, n, subsystems ? after_action : accept);
+            }
+            emit(p, BPF_JMP | BPF_JA, 0, 0, reject - p->len - 1);
+        }
+        after_action = p->len;
+
+        if (subsystems != NULL) {
+            /*
+             * Every key ends in a NUL, so a packet that ends in one has a
+             * NUL within it for the scan below to stop at.
+             */
+            emit(p, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+            emit(p, BPF_ALU | BPF_SUB | BPF_K, 0, 0, 1);
+            emit(p, BPF_MISC | BPF_TAX, 0, 0, 0);
+            emit(p, BPF_LD | BPF_B | BPF_IND, 0, 0, 0);
+            emit(p, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 0);
+            emit(p, BPF_JMP | BPF_JA, 0, 0, accept - p->len - 1);
+
+            /*
+             * Find the header's NUL. A load that sees zero jumps into a run
+             * of "add #1" with A = 0, entering it so that A ends up as the
+             * offset; jt only reaches 255 ahead, hence the segments.
+             */
+            for (base = 0; base < FILTER_SCAN_MAX; base += FILTER_SCAN_SEG) {
+                int chain = p->len + 2 * FILTER_SCAN_SEG + 1;
+
+                for (i = 0; i < FILTER_SCAN_SEG; i++) {
+                    emit(p, BPF_LD | BPF_B | BPF_ABS, 0, 0, base + i);
+                    emit(p, BPF_JMP | BPF_JEQ | BPF_K,
+                         chain + FILTER_SCAN_SEG - 1 - i - p->len - 1, 0, 0);
+                }
+                if (base + FILTER_SCAN_SEG < FILTER_SCAN_MAX)
+                    emit(p, BPF_JMP | BPF_JA, 0, 0, FILTER_SCAN_SEG + 1);
+                else    /* header too long to follow; let userspace decide */
+                    emit(p, BPF_JMP | BPF_JA, 0, 0, accept - p->len - 1);
+                for (i = 0; i < FILTER_SCAN_SEG - 1; i++)
+                    emit(p, BPF_ALU | BPF_ADD | BPF_K, 0, 0, 1);
+                emit(p, BPF_ALU | BPF_ADD | BPF_K, 0, 0, base);
+                emit(p, BPF_JMP | BPF_JA, 0, 0, found - p->len - 1);
+            }
+
+            found = p->len;
+            emit(p, BPF_ALU | BPF_MUL | BPF_K, 0, 0, 2);
+            emit(p, BPF_ALU | BPF_ADD | BPF_K, 0, 0, 17);
+            emit(p, BPF_MISC | BPF_TAX, 0, 0, 0);
+            /* "SUBSYSTEM=" has to fit past X */
+            emit(p, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+            emit(p, BPF_JMP | BPF_JGT | BPF_X, 1, 0, 0);
+            emit(p, BPF_JMP | BPF_JA, 0, 0, accept - p->len - 1);
+            emit(p, BPF_ALU | BPF_SUB | BPF_X, 0, 0, 0);
+            emit(p, BPF_JMP | BPF_JGE | BPF_K, 1, 0, 10);
+            emit(p, BPF_JMP | BPF_JA, 0, 0, accept - p->len - 1);
+            emit(p, BPF_LD | BPF_W | BPF_IND, 0, 0, 0);
+            emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 4, 0x53554253);   /* "SUBS" */
+            emit(p, BPF_LD | BPF_W | BPF_IND, 0, 0, 4);
+            emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0x59535445);   /* "YSTE" */
+            emit(p, BPF_LD | BPF_H | BPF_IND, 0, 0, 8);
+            emit(p, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 0x4d3d);       /* "M=" */
+            emit(p, BPF_JMP | BPF_JA, 0, 0, accept - p->len - 1);
+            for (i = 0; subsystems[i] != NULL; i++) {
+                /* include the NUL so "usb" doesn't match "usb_device" */
+                n = strlen(subsystems[i]) + 1;
+                emit_match(p, 1, 10, subsystems[i], n, accept);
+            }
+        }
+
+        reject = p->len;
+        emit(p, BPF_RET | BPF_K, 0, 0, 0);
+        accept = p->len;
+        emit(p, BPF_RET | BPF_K, 0, 0, 0xffffffff);
+
+        if (pass == 0) {
+            if (p->len > BPF_MAXINSNS)
+                return -1;
+            p->insns = malloc(p->len * sizeof(struct sock_filter));
+            if (p->insns == NULL)
+                return -1;
+            p->cap = p->len;
+        }
+    }
+    return 0;
+}
+
+int uevent_set_filter(const char * const *subsystems, const char * const *actions)
+{
+    struct filter_prog prog;
+    struct sock_fprog fprog;
+    int i, dummy = 0;
+    int ret;
+
+    if (fd < 0)
+        return -1;
+    /* the old and new programs would briefly count against optmem_max together */
+    setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy));
+    if (subsystems == NULL && actions == NULL)
+        return 0;
+    for (i = 0; subsystems && subsystems[i]; i++) {
+        if (strlen(subsystems[i]) > FILTER_STR_MAX)
+            return -1;
+    }
+    for (i = 0; actions && actions[i]; i++) {
+        if (strlen(actions[i]) > FILTER_STR_MAX)
+            return -1;
+    }
+
+    memset(&prog, 0, sizeof(prog));
+    if (build_filter(&prog, subsystems, actions) < 0) {
+        free(prog.insns);
+        return -1;
+    }
+    fprog.len = prog.len;
+    fprog.filter = prog.insns;
+    ret = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+    free(prog.insns);
+    return ret < 0 ? -1 : 0;
+}
+
+static void free_filtered_handler(struct uevent_filtered_handler *h)
+{
+    free(h->subsystem);
+    free(h->action);
+    free(h->devpath_prefix);
+    free(h);
+}
+
+/* Called with uevent_handler_list_lock held */
+static void reclaim_locked()
+{
+    struct handler_set *set;
+
+    if (__sync_fetch_and_add(&active_readers, 0) != 0)
+        return;
+    while ((set = retired_sets) != NULL) {
+        retired_sets = set->next_retired;
+        if (set->dropped)
+            free_filtered_handler(set->dropped);
+        free(set);
+    }
+}
+
+static struct handler_set *read_begin()
+{
+    /* the increment is a full barrier, so a writer that retires the set
+     * loaded below is guaranteed to see this reader */
+    __sync_fetch_and_add(&active_readers, 1);
+    return current_set;
+}
+
+static void read_end()
+{
+    if (__sync_sub_and_fetch(&active_readers, 1) == 0 && retired_sets != NULL &&
+            pthread_mutex_trylock(&uevent_handler_list_lock) == 0) {
+        reclaim_locked();
+        pthread_mutex_unlock(&uevent_handler_list_lock);
+    }
+}
+
+static struct handler_set *alloc_set(int num_handlers, int num_filtered)
+{
+    struct handler_set *set;
+
+    set = calloc(1, sizeof(*set) + num_handlers * sizeof(struct uevent_handler) +
+                 num_filtered * sizeof(struct uevent_filtered_handler *));
+    if (set == NULL)
+        return NULL;
+    set->num_handlers = num_handlers;
+    set->handlers = (struct uevent_handler *) (set + 1);
+    set->num_filtered = num_filtered;
+    set->filtered = (struct uevent_filtered_handler **) (set->handlers + num_handlers);
+    return set;
+}
+
+/*
+ * Makes 'set' current and retires the old one, which takes 'dropped' with
+ * it. Called with uevent_handler_list_lock held.
+ */
+static void publish_locked(struct handler_set *set, struct uevent_filtered_handler *dropped)
+{
+    struct handler_set *old = current_set;
+
+    __sync_synchronize();
+    current_set = set;
+    __sync_synchronize();
+    if (old != NULL) {
+        old->dropped = dropped;
+        old->next_retired = retired_sets;
+        retired_sets = old;
+    } else if (dropped != NULL) {
+        free_filtered_handler(dropped);
+    }
+    reclaim_locked();
+}
+
+static void dispatch(const struct handler_set *set, const char *buffer, int count)
+{
+    int i;
+
+    if (set == NULL)
+        return;
+    for (i = 0; i < set->num_handlers; i++)
+        set->handlers[i].handler(set->handlers[i].handler_data, buffer, count);
+    if (set->num_filtered > 0) {
+        struct uevent ev;
+        parse_uevent(buffer, count, &ev);
+        for (i = 0; i < set->num_filtered; i++) {
+            if (filter_matches(set->filtered[i], &ev))
+                set->filtered[i]->handler(set->filtered[i]->handler_data, &ev);
+        }
+    }
+}
+
 int uevent_next_event(char* buffer, int buffer_length)
 {
     while (1) {
@@ -84,11 +495,8 @@ int uevent_next_event(char* buffer, int buffer_length)
         if(nr > 0 && (fds.revents & POLLIN)) {
             int count = recv(fd, buffer, buffer_length, 0);
             if (count > 0) {
-                struct uevent_handler *h;
-                pthread_mutex_lock(&uevent_handler_list_lock);
-                LIST_FOREACH(h, &uevent_handler_list, list)
-                    h->handler(h->handler_data, buffer, buffer_length);
-                pthread_mutex_unlock(&uevent_handler_list_lock);
+                dispatch(read_begin(), buffer, count);
+                read_end();
 
                 return count;
             } 
@@ -99,38 +507,483 @@ int uevent_next_event(char* buffer, int buffer_length)
     return 0;
 }
 
+/* Set once recvmmsg() turns out to be missing */
+static int no_recvmmsg;
+
+/* Reads up to 'count' queued uevents without blocking; returns how many */
+static int recv_batch(struct uevent_batch_entry *events, int count)
+{
+    struct mmsghdr msgs[UEVENT_BATCH_MAX];
+    struct iovec iov[UEVENT_BATCH_MAX];
+    int i, nr;
+
+    if (!no_recvmmsg) {
+        memset(msgs, 0, count * sizeof(msgs[0]));
+        for (i = 0; i < count; i++) {
+            iov[i].iov_base = events[i].buffer;
+            iov[i].iov_len = events[i].buffer_length;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        nr = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL);
+        if (nr >= 0 || errno != ENOSYS) {
+            for (i = 0; i < nr; i++)
+                events[i].length = msgs[i].msg_len;
+            return nr < 0 ? 0 : nr;
+        }
+        no_recvmmsg = 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        nr = recv(fd, events[i].buffer, events[i].buffer_length, MSG_DONTWAIT);
+        if (nr < 0)
+            break;
+        events[i].length = nr;
+    }
+    return i;
+}
+
+/*
+ * Waits for uevents, then drains up to 'count' of them, and at most
+ * UEVENT_BATCH_MAX, without blocking and dispatches them all against one
+ * handler snapshot. Returns the number of events received.
+ */
+int uevent_next_events(struct uevent_batch_entry *events, int count)
+{
+    const struct handler_set *set;
+    int received = 0;
+    int i;
+
+    if (count <= 0)
+        return 0;
+    if (count > UEVENT_BATCH_MAX)
+        count = UEVENT_BATCH_MAX;
+
+    while (received == 0) {
+        struct pollfd fds;
+
+        fds.fd = fd;
+        fds.events = POLLIN;
+        fds.revents = 0;
+        if (poll(&fds, 1, -1) <= 0 || !(fds.revents & POLLIN))
+            continue;
+        received = recv_batch(events, count);
+    }
+
+    set = read_begin();
+    for (i = 0; i < received; i++) {
+        if (events[i].length > 0)
+            dispatch(set, events[i].buffer, events[i].length);
+    }
+    read_end();
+
+    return received;
+}
+
+/*
+ * Reactor: a library thread that reads the uevent socket and dispatches.
+ * With a coalescing window, "change" events are held per DEVPATH and only
+ * the latest is dispatched, once the window from the first one has passed.
+ * Any other action on the device flushes the held change first, so order
+ * per device is kept.
+ */
+#define REACTOR_MSG_SIZE        4096
+#define REACTOR_MAX_PENDING     32
+
+struct pending_change {
+    char *msg;
+    int len;
+    const char *devpath;    /* into msg */
+    int64_t deadline;
+};
+
+static pthread_t reactor_thread;
+static int reactor_running;
+static int reactor_coalesce_ms;
+static int reactor_stop_fd = -1;
+static int reactor_timer_fd = -1;
+static int reactor_notify_fd = -1;
+static int reactor_epfd = -1;
+static char *reactor_buf;
+static struct pending_change reactor_pending[REACTOR_MAX_PENDING];
+static int reactor_num_pending;
+static pthread_mutex_t reactor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t reactor_now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void reactor_deliver(const char *msg, int len)
+{
+    uint64_t one = 1;
+
+    dispatch(read_begin(), msg, len);
+    read_end();
+    /* EAGAIN means the counter is saturated, so the reader has a wakeup due anyway */
+    if (TEMP_FAILURE_RETRY(write(reactor_notify_fd, &one, sizeof(one))) < 0 && errno != EAGAIN)
+        ALOGW("Unable to signal uevent reactor listeners: %s", strerror(errno));
+}
+
+static void reactor_flush(int i)
+{
+    struct pending_change *pc = &reactor_pending[i];
+
+    reactor_deliver(pc->msg, pc->len);
+    free(pc->msg);
+    reactor_pending[i] = reactor_pending[--reactor_num_pending];
+}
+
+static void reactor_arm_timer()
+{
+    struct itimerspec its;
+    int64_t first = INT64_MAX, wait;
+    int i;
+
+    memset(&its, 0, sizeof(its));
+    for (i = 0; i < reactor_num_pending; i++) {
+        if (reactor_pending[i].deadline < first)
+            first = reactor_pending[i].deadline;
+    }
+    if (reactor_num_pending > 0) {
+        wait = first - reactor_now_ms();
+        if (wait < 1)
+            wait = 1;   /* zero would disarm it */
+        its.it_value.tv_sec = wait / 1000;
+        its.it_value.tv_nsec = (wait % 1000) * 1000000;
+    }
+    timerfd_settime(reactor_timer_fd, 0, &its, NULL);
+}
+
+static void reactor_handle(const char *msg, int len)
+{
+    struct uevent ev;
+    int i;
+
+    parse_uevent(msg, len, &ev);
+    for (i = 0; ev.devpath && i < reactor_num_pending; i++) {
+        if (strcmp(reactor_pending[i].devpath, ev.devpath) == 0)
+            break;
+    }
+    if (ev.devpath == NULL || ev.action == NULL || strcmp(ev.action, "change") != 0) {
+        if (ev.devpath && i < reactor_num_pending)
+            reactor_flush(i);
+        reactor_deliver(msg, len);
+        return;
+    }
+
+    if (i < reactor_num_pending) {
+        /* replace the held event but keep its deadline */
+        struct pending_change *pc = &reactor_pending[i];
+        char *copy = malloc(len);
+
+        if (copy == NULL) {
+            reactor_flush(i);
+            reactor_deliver(msg, len);
+            return;
+        }
+        memcpy(copy, msg, len);
+        free(pc->msg);
+        pc->msg = copy;
+        pc->len = len;
+        pc->devpath = copy + (ev.devpath - msg);
+        return;
+    }
+
+    if (reactor_num_pending == REACTOR_MAX_PENDING) {
+        int oldest = 0;
+        for (i = 1; i < reactor_num_pending; i++) {
+            if (reactor_pending[i].deadline < reactor_pending[oldest].deadline)
+                oldest = i;
+        }
+        reactor_flush(oldest);
+    }
+    i = reactor_num_pending;
+    reactor_pending[i].msg = malloc(len);
+    if (reactor_pending[i].msg == NULL) {
+        reactor_deliver(msg, len);
+        return;
+    }
+    memcpy(reactor_pending[i].msg, msg, len);
+    reactor_pending[i].len = len;
+    reactor_pending[i].devpath = reactor_pending[i].msg + (ev.devpath - msg);
+    reactor_pending[i].deadline = reactor_now_ms() + reactor_coalesce_ms;
+    reactor_num_pending++;
+}
+
+/* Adds 'watch_fd' to the reactor's epoll set. Called with reactor_lock held */
+static int reactor_watch(int watch_fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = watch_fd;
+    return epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, watch_fd, &ev);
+}
+
+static void *reactor_loop(void *arg)
+{
+    struct epoll_event events[3];
+    char *buf = reactor_buf;
+    int i, n;
+
+    (void) arg;
+    for (;;) {
+        int stop = 0;
+
+        n = epoll_wait(reactor_epfd, events, 3, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == reactor_stop_fd) {
+                stop = 1;
+            } else if (events[i].data.fd == reactor_timer_fd) {
+                uint64_t expirations;
+                int64_t now = reactor_now_ms();
+                int j;
+
+                if (read(reactor_timer_fd, &expirations, sizeof(expirations)) !=
+                        sizeof(expirations))
+                    continue;   /* re-armed since; nothing expired */
+                for (j = reactor_num_pending - 1; j >= 0; j--) {
+                    if (reactor_pending[j].deadline <= now)
+                        reactor_flush(j);
+                }
+            } else {
+                int len;
+
+                while ((len = recv(fd, buf, REACTOR_MSG_SIZE, MSG_DONTWAIT)) > 0) {
+                    if (reactor_coalesce_ms > 0)
+                        reactor_handle(buf, len);
+                    else
+                        reactor_deliver(buf, len);
+                }
+            }
+        }
+        if (stop)
+            break;
+        if (reactor_coalesce_ms > 0)
+            reactor_arm_timer();
+    }
+
+    /* don't lose held events */
+    while (reactor_num_pending > 0)
+        reactor_flush(reactor_num_pending - 1);
+    return NULL;
+}
+
+/* Called with reactor_lock held; frees what uevent_reactor_start() set up */
+static void reactor_release()
+{
+    if (reactor_stop_fd >= 0)
+        close(reactor_stop_fd);
+    if (reactor_timer_fd >= 0)
+        close(reactor_timer_fd);
+    if (reactor_epfd >= 0)
+        close(reactor_epfd);
+    free(reactor_buf);
+    reactor_stop_fd = reactor_timer_fd = reactor_epfd = -1;
+    reactor_buf = NULL;
+}
+
+/*
+ * Starts the reactor thread, initializing the uevent socket if needed.
+ * Events seen within 'coalesce_ms' are coalesced as described above;
+ * 0 dispatches every event as it arrives.
+ */
+int uevent_reactor_start(int coalesce_ms)
+{
+    pthread_mutex_lock(&reactor_lock);
+    if (reactor_running) {
+        pthread_mutex_unlock(&reactor_lock);
+        return 0;
+    }
+    if (fd < 0 && !uevent_init())
+        goto fail;
+    reactor_coalesce_ms = coalesce_ms > 0 ? coalesce_ms : 0;
+    reactor_stop_fd = eventfd(0, EFD_CLOEXEC);
+    reactor_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (reactor_notify_fd < 0)
+        reactor_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reactor_epfd = epoll_create1(EPOLL_CLOEXEC);
+    reactor_buf = malloc(REACTOR_MSG_SIZE);
+    if (reactor_stop_fd < 0 || reactor_timer_fd < 0 || reactor_notify_fd < 0 ||
+            reactor_epfd < 0 || reactor_buf == NULL)
+        goto fail;
+    if (reactor_watch(fd) < 0 || reactor_watch(reactor_timer_fd) < 0 ||
+            reactor_watch(reactor_stop_fd) < 0)
+        goto fail;
+    if (pthread_create(&reactor_thread, NULL, reactor_loop, NULL) != 0)
+        goto fail;
+    reactor_running = 1;
+    pthread_mutex_unlock(&reactor_lock);
+    return 0;
+
+fail:
+    reactor_release();
+    pthread_mutex_unlock(&reactor_lock);
+    return -1;
+}
+
+int uevent_reactor_stop()
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&reactor_lock);
+    if (!reactor_running) {
+        pthread_mutex_unlock(&reactor_lock);
+        return -1;
+    }
+    /* the thread would never see a failed write; leave it running */
+    if (TEMP_FAILURE_RETRY(write(reactor_stop_fd, &one, sizeof(one))) != sizeof(one)) {
+        pthread_mutex_unlock(&reactor_lock);
+        return -1;
+    }
+    pthread_join(reactor_thread, NULL);
+    reactor_release();
+    reactor_running = 0;
+    pthread_mutex_unlock(&reactor_lock);
+    return 0;
+}
+
+/*
+ * Returns an eventfd that the reactor signals after each dispatch, for
+ * callers that want to wake their own loop. It stays valid across
+ * stop/start.
+ */
+int uevent_reactor_get_fd()
+{
+    int ret;
+
+    pthread_mutex_lock(&reactor_lock);
+    if (reactor_notify_fd < 0)
+        reactor_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ret = reactor_notify_fd;
+    pthread_mutex_unlock(&reactor_lock);
+    return ret;
+}
+
 int uevent_add_native_handler(void (*handler)(void *data, const char *msg, int msg_len),
                              void *handler_data)
 {
-    struct uevent_handler *h;
+    struct handler_set *old, *set;
 
-    h = malloc(sizeof(struct uevent_handler));
+    pthread_mutex_lock(&uevent_handler_list_lock);
+    old = current_set;
+    set = alloc_set((old ? old->num_handlers : 0) + 1, old ? old->num_filtered : 0);
+    if (set == NULL) {
+        pthread_mutex_unlock(&uevent_handler_list_lock);
+        return -1;
+    }
+    /* newest first, as before */
+    set->handlers[0].handler = handler;
+    set->handlers[0].handler_data = handler_data;
+    if (old != NULL) {
+        memcpy(set->handlers + 1, old->handlers, old->num_handlers * sizeof(struct uevent_handler));
+        memcpy(set->filtered, old->filtered,
+               old->num_filtered * sizeof(struct uevent_filtered_handler *));
+    }
+    publish_locked(set, NULL);
+    pthread_mutex_unlock(&uevent_handler_list_lock);
+
+    return 0;
+}
+
+int uevent_remove_native_handler(void (*handler)(void *data, const char *msg, int msg_len))
+{
+    struct handler_set *old, *set;
+    int i, j;
+
+    pthread_mutex_lock(&uevent_handler_list_lock);
+    old = current_set;
+    for (i = 0; old != NULL && i < old->num_handlers; i++) {
+        if (old->handlers[i].handler == handler)
+            break;
+    }
+    if (old == NULL || i == old->num_handlers ||
+            (set = alloc_set(old->num_handlers - 1, old->num_filtered)) == NULL) {
+        pthread_mutex_unlock(&uevent_handler_list_lock);
+        return -1;
+    }
+    for (j = 0; j < old->num_handlers - 1; j++)
+        set->handlers[j] = old->handlers[j < i ? j : j + 1];
+    memcpy(set->filtered, old->filtered,
+           old->num_filtered * sizeof(struct uevent_filtered_handler *));
+    publish_locked(set, NULL);
+    pthread_mutex_unlock(&uevent_handler_list_lock);
+
+    return 0;
+}
+
+int uevent_add_filtered_handler(const struct uevent_filter *filter,
+                                void (*handler)(void *data, const struct uevent *event),
+                                void *handler_data)
+{
+    struct uevent_filtered_handler *h;
+    struct handler_set *old, *set;
+
+    h = calloc(1, sizeof(struct uevent_filtered_handler));
     if (h == NULL)
         return -1;
     h->handler = handler;
     h->handler_data = handler_data;
+    if (filter != NULL) {
+        if ((filter->subsystem && !(h->subsystem = strdup(filter->subsystem))) ||
+                (filter->action && !(h->action = strdup(filter->action))) ||
+                (filter->devpath_prefix && !(h->devpath_prefix = strdup(filter->devpath_prefix)))) {
+            free_filtered_handler(h);
+            return -1;
+        }
+        if (h->devpath_prefix)
+            h->devpath_prefix_len = strlen(h->devpath_prefix);
+    }
 
     pthread_mutex_lock(&uevent_handler_list_lock);
-    LIST_INSERT_HEAD(&uevent_handler_list, h, list);
+    old = current_set;
+    set = alloc_set(old ? old->num_handlers : 0, (old ? old->num_filtered : 0) + 1);
+    if (set == NULL) {
+        pthread_mutex_unlock(&uevent_handler_list_lock);
+        free_filtered_handler(h);
+        return -1;
+    }
+    set->filtered[0] = h;
+    if (old != NULL) {
+        memcpy(set->handlers, old->handlers, old->num_handlers * sizeof(struct uevent_handler));
+        memcpy(set->filtered + 1, old->filtered,
+               old->num_filtered * sizeof(struct uevent_filtered_handler *));
+    }
+    publish_locked(set, NULL);
     pthread_mutex_unlock(&uevent_handler_list_lock);
 
     return 0;
 }
 
-int uevent_remove_native_handler(void (*handler)(void *data, const char *msg, int msg_len))
+int uevent_remove_filtered_handler(void (*handler)(void *data, const struct uevent *event))
 {
-    struct uevent_handler *h;
-    int err = -1;
+    struct handler_set *old, *set;
+    int i, j;
 
     pthread_mutex_lock(&uevent_handler_list_lock);
-    LIST_FOREACH(h, &uevent_handler_list, list) {
-        if (h->handler == handler) {
-            LIST_REMOVE(h, list);
-            err = 0;
+    old = current_set;
+    for (i = 0; old != NULL && i < old->num_filtered; i++) {
+        if (old->filtered[i]->handler == handler)
             break;
-       }
     }
+    if (old == NULL || i == old->num_filtered ||
+            (set = alloc_set(old->num_handlers, old->num_filtered - 1)) == NULL) {
+        pthread_mutex_unlock(&uevent_handler_list_lock);
+        return -1;
+    }
+    memcpy(set->handlers, old->handlers, old->num_handlers * sizeof(struct uevent_handler));
+    for (j = 0; j < old->num_filtered - 1; j++)
+        set->filtered[j] = old->filtered[j < i ? j : j + 1];
+    /* a dispatch may still be calling it; it goes when 'old' does */
+    publish_locked(set, old->filtered[i]);
     pthread_mutex_unlock(&uevent_handler_list_lock);
 
-    return err;
+    return 0;
 }
@@ -17,50 +17,136 @@
 #include "qemu.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
 
 #define THE_DEVICE "/sys/class/timed_output/vibrator/enable"
 
-int vibrator_exists()
+/* The device is opened once and kept open; the first open doubles as
+ * the existence probe. */
+static pthread_mutex_t vib_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t vib_probe_once = PTHREAD_ONCE_INIT;
+static int vib_fd = -1;
+static int vib_present;
+
+/* the pattern being played, run by the worker thread */
+static pthread_t pattern_thread;
+static int pattern_thread_started;
+static int pattern_timer_fd = -1;
+static int *pattern;
+static int pattern_count;
+static int pattern_repeat;
+static int pattern_pos;
+static int pattern_active;
+static int64_t pattern_next;    /* CLOCK_MONOTONIC ns of the next step */
+static int64_t motor_on_until;  /* when the last timed write runs out */
+
+static int64_t now_ns()
 {
-    int fd;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
+static void probe_device()
+{
 #ifdef QEMU_HARDWARE
     if (qemu_check()) {
-        return 1;
+        vib_present = 1;
+        return;
     }
 #endif
 
-    fd = open(THE_DEVICE, O_RDWR);
-    if(fd < 0)
-        return 0;
-    close(fd);
-    return 1;
+    vib_fd = open(THE_DEVICE, O_RDWR | O_CLOEXEC);
+    vib_present = vib_fd >= 0;
 }
 
-static int sendit(int timeout_ms)
+int vibrator_exists()
 {
-    int nwr, ret, fd;
+    pthread_once(&vib_probe_once, probe_device);
+    return vib_present;
+}
+
+/* Called with vib_lock held */
+static int sendit_locked(int timeout_ms)
+{
+    int nwr, ret, attempt;
     char value[20];
 
 #ifdef QEMU_HARDWARE
     if (qemu_check()) {
-        return qemu_control_command( "vibrator:%d", timeout_ms );
+        ret = qemu_control_command( "vibrator:%d", timeout_ms );
+        if (ret == 0)
+            motor_on_until = timeout_ms > 0 ? now_ns() + timeout_ms * 1000000LL : 0;
+        return ret;
     }
 #endif
 
-    fd = open(THE_DEVICE, O_RDWR);
-    if(fd < 0)
-        return errno;
-
     nwr = sprintf(value, "%d\n", timeout_ms);
-    ret = write(fd, value, nwr);
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (vib_fd < 0)
+            vib_fd = open(THE_DEVICE, O_RDWR | O_CLOEXEC);
+        if (vib_fd < 0)
+            return errno;
 
-    close(fd);
+        ret = write(vib_fd, value, nwr);
+        if (ret == nwr) {
+            motor_on_until = timeout_ms > 0 ? now_ns() + timeout_ms * 1000000LL : 0;
+            return 0;
+        }
+        /* reopen once in case the device went away under us */
+        close(vib_fd);
+        vib_fd = -1;
+    }
+    return -1;
+}
+
+/* Called with vib_lock held */
+static int arm_timer_locked(int64_t when)
+{
+    struct itimerspec its;
 
-    return (ret == nwr) ? 0 : -1;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = when / 1000000000LL;
+    its.it_value.tv_nsec = when % 1000000000LL;
+    return timerfd_settime(pattern_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Called with vib_lock held; stops any pattern without touching the motor */
+static void cancel_pattern_locked()
+{
+    if (!pattern_active)
+        return;
+    pattern_active = 0;
+    arm_timer_locked(0);    /* disarm; a stale expiry finds nothing to do */
+}
+
+/* Called with vib_lock held */
+static int stop_motor_locked()
+{
+    if (motor_on_until <= now_ns())
+        return 0;
+    return sendit_locked(0);
+}
+
+static int sendit(int timeout_ms)
+{
+    int ret;
+
+    pthread_once(&vib_probe_once, probe_device);
+    pthread_mutex_lock(&vib_lock);
+    cancel_pattern_locked();
+    ret = sendit_locked(timeout_ms);
+    pthread_mutex_unlock(&vib_lock);
+    return ret;
 }
 
 int vibrator_on(int timeout_ms)
@@ -73,3 +159,134 @@ int vibrator_off()
 {
     return sendit(0);
 }
+
+/*
+ * Plays every step that is due and arms the timer for the next one.
+ * Steps alternate off and on, starting with off; an "on" step is a single
+ * timed write, and the driver turns the motor off by itself when it ends.
+ * Deadlines are absolute, so steps don't drift. Called with vib_lock held.
+ */
+static int run_pattern_locked()
+{
+    int64_t now = now_ns();
+
+    while (pattern_active && pattern_next <= now) {
+        int ms = pattern[pattern_pos];
+
+        if ((pattern_pos & 1) && ms > 0)
+            sendit_locked(ms);
+        pattern_next += (int64_t) ms * 1000000LL;
+        if (++pattern_pos == pattern_count) {
+            if (pattern_repeat < 0)
+                pattern_active = 0;
+            else
+                pattern_pos = pattern_repeat;
+        }
+    }
+
+    if (!pattern_active)
+        return 0;
+    if (arm_timer_locked(pattern_next) < 0) {
+        pattern_active = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void *pattern_loop(void *arg)
+{
+    uint64_t count;
+    int ret;
+
+    for (;;) {
+        /* blocks while the timer is disarmed */
+        ret = TEMP_FAILURE_RETRY(read(pattern_timer_fd, &count, sizeof(count)));
+        if (ret != sizeof(count))
+            continue;
+
+        pthread_mutex_lock(&vib_lock);
+        run_pattern_locked();
+        pthread_mutex_unlock(&vib_lock);
+    }
+    return NULL;
+}
+
+/* Called with vib_lock held */
+static int start_pattern_thread_locked()
+{
+    pthread_attr_t attr;
+
+    if (pattern_thread_started)
+        return 0;
+    pattern_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (pattern_timer_fd < 0)
+        return -1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pattern_thread_started = pthread_create(&pattern_thread, &attr, pattern_loop, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    if (pattern_thread_started)
+        return 0;
+
+    close(pattern_timer_fd);
+    pattern_timer_fd = -1;
+    return -1;
+}
+
+int vibrator_pattern(const int *durations_ms, int count, int repeat)
+{
+    int64_t loop_ms = 0;
+    int *copy;
+    int i, ret;
+
+    if (durations_ms == NULL || count <= 0 || repeat >= count)
+        return -1;
+    for (i = 0; i < count; i++) {
+        if (durations_ms[i] < 0)
+            return -1;
+        if (repeat >= 0 && i >= repeat)
+            loop_ms += durations_ms[i];
+    }
+    /* a repeating part with no length would spin */
+    if (repeat >= 0 && loop_ms == 0)
+        return -1;
+
+    copy = malloc(count * sizeof(int));
+    if (copy == NULL)
+        return -1;
+    memcpy(copy, durations_ms, count * sizeof(int));
+
+    pthread_once(&vib_probe_once, probe_device);
+    pthread_mutex_lock(&vib_lock);
+    if (start_pattern_thread_locked() < 0) {
+        pthread_mutex_unlock(&vib_lock);
+        free(copy);
+        return -1;
+    }
+    cancel_pattern_locked();
+    stop_motor_locked();    /* a step of the old pattern may still be running */
+    free(pattern);
+    pattern = copy;
+    pattern_count = count;
+    pattern_repeat = repeat < 0 ? -1 : repeat;
+    pattern_pos = 0;
+    pattern_active = 1;
+    pattern_next = now_ns();
+    /* play the steps due now here; the worker picks up the rest */
+    ret = run_pattern_locked();
+    pthread_mutex_unlock(&vib_lock);
+    return ret;
+}
+
+int vibrator_cancel()
+{
+    int ret;
+
+    pthread_once(&vib_probe_once, probe_device);
+    pthread_mutex_lock(&vib_lock);
+    cancel_pattern_locked();
+    ret = stop_motor_locked();
+    pthread_mutex_unlock(&vib_lock);
+    return ret;
+}
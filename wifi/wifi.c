@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
@@ -22,6 +23,19 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <arpa/inet.h>
 
 #include "hardware_legacy/wifi.h"
 #include "libwpa_client/wpa_ctrl.h"
@@ -37,17 +51,73 @@
 #include <sys/_system_properties.h>
 #endif
 
-static struct wpa_ctrl *ctrl_conn;
-static struct wpa_ctrl *monitor_conn;
+#define WIFI_MAX_IFACES		4
+#define WIFI_CTRL_POOL_SIZE	3
 
-/* socket pair used to exit from a blocking read */
-static int exit_sockets[2] = {-1, -1};
+enum {
+    CTRL_SLOT_EMPTY = 0,
+    CTRL_SLOT_IDLE,
+    CTRL_SLOT_BUSY
+};
+
+/*
+ * Supplicant connection state for one interface. Commands are spread over
+ * a small pool of control connections, opened on demand, so that traffic
+ * for different interfaces (or concurrent callers on the same interface)
+ * doesn't serialize on a single socket. Events arrive on monitor_conn.
+ */
+struct wifi_iface_conn {
+    int in_use;
+    unsigned int gen;
+    char name[PROPERTY_VALUE_MAX];
+    char path[PATH_MAX];
+    struct wpa_ctrl *ctrl_pool[WIFI_CTRL_POOL_SIZE];
+    int ctrl_state[WIFI_CTRL_POOL_SIZE];
+    struct wpa_ctrl *monitor_conn;
+    int monitor_reading;
+};
+
+static struct wifi_iface_conn iface_conns[WIFI_MAX_IFACES];
+static unsigned int iface_conn_gen;
+/*
+ * Protects iface_conns and the monitor state below. conn_state_cond is
+ * broadcast whenever a pool slot, a monitor reader or the monitor waiter
+ * count changes, so teardown can wait for users to leave.
+ */
+static pthread_mutex_t iface_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_state_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Persistent epoll set holding the monitor socket of every connected
+ * interface plus exit_event_fd. Ready events from one epoll_wait() are
+ * kept in monitor_events[] and consumed across calls, and a ready socket
+ * is drained with non-blocking reads before epoll is consulted again.
+ */
+#define WIFI_MONITOR_MAX_EVENTS	(WIFI_MAX_IFACES + 1)
+#define MONITOR_EXIT_KEY	0
+
+static int monitor_epfd = -1;
+static struct epoll_event monitor_events[WIFI_MONITOR_MAX_EVENTS];
+static int monitor_nevents;
+static int monitor_next;
+static int monitor_waiters;
+/* serializes callers of wifi_wait_for_event() */
+static pthread_mutex_t monitor_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* eventfd used to exit from a blocking read; stays signalled once written */
+static int exit_event_fd = -1;
+/* set while the async DHCP path keeps the ifc socket open */
+static int dhcp_ifc_held;
+static pthread_mutex_t dhcp_lock = PTHREAD_MUTEX_INITIALIZER;
+static int exit_signalled;
 
 extern int do_dhcp();
 extern int ifc_init();
 extern void ifc_close();
 extern char *dhcp_lasterror();
 extern void get_dhcp_info();
+extern int ifc_up(const char *name);
+extern int ifc_down(const char *name);
 extern int init_module(void *, unsigned long, const char *);
 extern int delete_module(const char *, unsigned int);
 void wifi_close_sockets();
@@ -122,19 +192,52 @@ static char supplicant_name[PROPERTY_VALUE_MAX];
 /* Is either SUPP_PROP_NAME or P2P_PROP_NAME */
 static char supplicant_prop_name[PROPERTY_KEY_MAX];
 
+static int64_t wifi_now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Loads a module straight from its file with finit_module() where the
+ * kernel supports it. Otherwise, or if finit_module() refuses the file
+ * (no syscall, seccomp, a module signing policy that only covers
+ * init_module, ...), init_module() gets a read-only mapping of the file
+ * rather than a heap copy of it.
+ */
 static int insmod(const char *filename, const char *args)
 {
     void *module;
-    unsigned int size;
+    struct stat sb;
+    int fd;
     int ret;
 
-    module = load_file(filename, &size);
-    if (!module)
+    fd = TEMP_FAILURE_RETRY(open(filename, O_RDONLY));
+    if (fd < 0)
         return -1;
 
-    ret = init_module(module, size, args);
+#ifdef __NR_finit_module
+    ret = syscall(__NR_finit_module, fd, args, 0);
+    if (ret == 0 || errno == EEXIST) {
+        close(fd);
+        return ret;
+    }
+#endif
+
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        return -1;
+    }
+    module = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (module == MAP_FAILED)
+        return -1;
 
-    free(module);
+    ret = init_module(module, sb.st_size, args);
+
+    munmap(module, sb.st_size);
 
     return ret;
 }
@@ -158,6 +261,100 @@ static int rmmod(const char *modname)
     return ret;
 }
 
+/*
+ * Supplicant state waits. bionic's property-area wait has no deadline, so
+ * the waits below block on inotify for the supplicant's control socket,
+ * IFACE_DIR/<interface>, being created as it starts or removed as it
+ * exits. init updates the service property around the same time, so after
+ * a socket event the property is re-checked every WIFI_PROP_SETTLE_MS for
+ * a while; otherwise it is re-checked every WIFI_PROP_RECHECK_MS, which
+ * also covers supplicants that don't put their socket in IFACE_DIR.
+ */
+#define WIFI_PROP_RECHECK_MS	100
+#define WIFI_PROP_SETTLE_MS	5
+#define WIFI_PROP_SETTLE_CHECKS	20
+
+struct state_wait {
+    int watch_fd;
+    int64_t deadline;
+    int settle;
+    char ifname[PROPERTY_VALUE_MAX];
+};
+
+/*
+ * Starts a wait that ends 'timeout_ms' from now, watching IFACE_DIR for
+ * the control socket of 'ifname' unless it is NULL. Begin before
+ * triggering the change, so the socket event can't be missed.
+ */
+static void state_wait_begin(struct state_wait *w, int timeout_ms, const char *ifname)
+{
+    w->watch_fd = ifname != NULL ? inotify_init() : -1;
+    strlcpy(w->ifname, ifname != NULL ? ifname : "", sizeof(w->ifname));
+    if (w->watch_fd >= 0 && inotify_add_watch(w->watch_fd, IFACE_DIR,
+            IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM) < 0) {
+        close(w->watch_fd);
+        w->watch_fd = -1;
+    }
+    w->deadline = wifi_now_ms() + timeout_ms;
+    w->settle = 0;
+}
+
+static void state_wait_end(struct state_wait *w)
+{
+    if (w->watch_fd >= 0)
+        close(w->watch_fd);
+}
+
+/*
+ * Blocks until the watched control socket appears or
+ * goes away, or until it is time to re-check the state. Returns -1 once
+ * past the deadline.
+ */
+static int state_wait_next(struct state_wait *w)
+{
+    char events[512] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int64_t remaining = w->deadline - wifi_now_ms();
+    struct pollfd pfd;
+    ssize_t len, off;
+
+    if (remaining <= 0)
+        return -1;
+    if (w->settle > 0) {
+        w->settle--;
+        if (remaining > WIFI_PROP_SETTLE_MS)
+            remaining = WIFI_PROP_SETTLE_MS;
+    } else if (remaining > WIFI_PROP_RECHECK_MS) {
+        remaining = WIFI_PROP_RECHECK_MS;
+    }
+    if (w->watch_fd < 0) {
+        usleep(remaining * 1000);
+        return 0;
+    }
+    pfd.fd = w->watch_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (TEMP_FAILURE_RETRY(poll(&pfd, 1, remaining)) <= 0 || !(pfd.revents & POLLIN))
+        return 0;
+    len = TEMP_FAILURE_RETRY(read(w->watch_fd, events, sizeof(events)));
+    for (off = 0; off + (ssize_t) sizeof(struct inotify_event) <= len; ) {
+        const struct inotify_event *ev = (const struct inotify_event *) (events + off);
+
+        if (ev->len > 0 && strcmp(ev->name, w->ifname) == 0)
+            w->settle = WIFI_PROP_SETTLE_CHECKS;
+        off += sizeof(*ev) + ev->len;
+    }
+    return 0;
+}
+
+/* Closes the ifc socket unless the async DHCP path is keeping it open */
+static void ifc_close_unless_held()
+{
+    pthread_mutex_lock(&dhcp_lock);
+    if (!dhcp_ifc_held)
+        ifc_close();
+    pthread_mutex_unlock(&dhcp_lock);
+}
+
 int do_dhcp_request(int *ipaddr, int *gateway, int *mask,
                     int *dns1, int *dns2, int *server, int *lease) {
     /* For test driver, always report success */
@@ -168,10 +365,10 @@ int do_dhcp_request(int *ipaddr, int *gateway, int *mask,
         return -1;
 
     if (do_dhcp(primary_iface) < 0) {
-        ifc_close();
+        ifc_close_unless_held();
         return -1;
     }
-    ifc_close();
+    ifc_close_unless_held();
     get_dhcp_info(ipaddr, gateway, mask, dns1, dns2, server, lease);
     return 0;
 }
@@ -180,6 +377,306 @@ const char *get_dhcp_error_string() {
     return dhcp_lasterror();
 }
 
+/*
+ * Asynchronous DHCP. One request runs at a time on a worker thread; the
+ * result is handed to the callback and also left for wifi_dhcp_get_result(),
+ * with the eventfd from wifi_dhcp_get_fd() signalled on completion.
+ */
+#define DHCP_RTNL_BUF_SIZE	8192
+
+static pthread_cond_t dhcp_idle_cond = PTHREAD_COND_INITIALIZER;
+static int dhcp_busy;
+static int dhcp_result_ready;
+static int dhcp_event_fd = -1;
+static struct wifi_dhcp_result dhcp_result;
+static wifi_dhcp_callback dhcp_cb;
+static void *dhcp_cb_arg;
+
+static int open_rtnl_socket()
+{
+    struct sockaddr_nl addr;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int rtnl_request_dump(int fd, int type)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct rtgenmsg g;
+    } req;
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.g));
+    req.nh.nlmsg_type = type;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nh.nlmsg_seq = type;
+    req.g.rtgen_family = AF_INET;
+    return TEMP_FAILURE_RETRY(send(fd, &req, req.nh.nlmsg_len, 0)) < 0 ? -1 : 0;
+}
+
+#define DHCP_HAVE_ADDR	1
+#define DHCP_HAVE_GW	2
+#define DHCP_NO_ADDR	4	/* the kernel says the interface has no address */
+
+/*
+ * Applies the address and route messages for 'ifindex' in 'buf' to 'r',
+ * updating the DHCP_HAVE_* bits in 'found'. A deleted address (e.g. a
+ * lost lease) clears what an earlier message set. Returns 1 at the end
+ * of a dump.
+ */
+static int rtnl_parse(const char *buf, int len, int ifindex, struct wifi_dhcp_result *r,
+                      int *found)
+{
+    const struct nlmsghdr *nh;
+    int done = 0;
+
+    for (nh = (const struct nlmsghdr *) buf; NLMSG_OK(nh, (unsigned) len);
+            nh = NLMSG_NEXT(nh, len)) {
+        if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) {
+            done = 1;
+        } else if (nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR) {
+            const struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+            const struct rtattr *rta = IFA_RTA(ifa);
+            int alen = IFA_PAYLOAD(nh);
+            int addr;
+
+            if (ifa->ifa_family != AF_INET || (int) ifa->ifa_index != ifindex)
+                continue;
+            for (; RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+                if (rta->rta_type != IFA_LOCAL)
+                    continue;
+                memcpy(&addr, RTA_DATA(rta), 4);
+                if (nh->nlmsg_type == RTM_DELADDR) {
+                    if (addr == r->ipaddr) {
+                        r->ipaddr = 0;
+                        r->mask = 0;
+                        *found &= ~DHCP_HAVE_ADDR;
+                    }
+                    continue;
+                }
+                r->ipaddr = addr;
+                r->mask = ifa->ifa_prefixlen == 0 ? 0 :
+                        (int) htonl(0xffffffffu << (32 - ifa->ifa_prefixlen));
+                *found |= DHCP_HAVE_ADDR;
+            }
+        } else if (nh->nlmsg_type == RTM_NEWROUTE) {
+            const struct rtmsg *rtm = NLMSG_DATA(nh);
+            const struct rtattr *rta = RTM_RTA(rtm);
+            int alen = RTM_PAYLOAD(nh);
+            int oif = 0, gw = 0, have_gw = 0;
+
+            /* only the default route carries the gateway we want */
+            if (rtm->rtm_family != AF_INET || rtm->rtm_dst_len != 0)
+                continue;
+            for (; RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+                if (rta->rta_type == RTA_OIF) {
+                    memcpy(&oif, RTA_DATA(rta), sizeof(oif));
+                } else if (rta->rta_type == RTA_GATEWAY) {
+                    memcpy(&gw, RTA_DATA(rta), 4);
+                    have_gw = 1;
+                }
+            }
+            if (have_gw && oif == ifindex) {
+                r->gateway = gw;
+                *found |= DHCP_HAVE_GW;
+            }
+        }
+    }
+    return done;
+}
+
+/*
+ * Reads the interface address and default gateway from rtnetlink into 'r'.
+ * The notifications queued on 'fd' while the DHCP exchange ran are used
+ * first; anything they didn't cover (e.g. a renewal that kept the same
+ * address, which produces no event) is filled from a dump. If the address
+ * dump finds none, DHCP_NO_ADDR is returned.
+ */
+static int rtnl_read_config(int fd, int ifindex, struct wifi_dhcp_result *r)
+{
+    char *buf;
+    int found = 0;
+    int len;
+
+    buf = malloc(DHCP_RTNL_BUF_SIZE);
+    if (buf == NULL)
+        return 0;
+    while ((len = TEMP_FAILURE_RETRY(recv(fd, buf, DHCP_RTNL_BUF_SIZE, MSG_DONTWAIT))) > 0)
+        rtnl_parse(buf, len, ifindex, r, &found);
+
+    if (!(found & DHCP_HAVE_ADDR) && rtnl_request_dump(fd, RTM_GETADDR) == 0) {
+        while ((len = TEMP_FAILURE_RETRY(recv(fd, buf, DHCP_RTNL_BUF_SIZE, 0))) > 0) {
+            if (rtnl_parse(buf, len, ifindex, r, &found)) {
+                if (!(found & DHCP_HAVE_ADDR))
+                    found |= DHCP_NO_ADDR;
+                break;
+            }
+        }
+    }
+    if (!(found & DHCP_HAVE_GW) && rtnl_request_dump(fd, RTM_GETROUTE) == 0) {
+        while ((len = TEMP_FAILURE_RETRY(recv(fd, buf, DHCP_RTNL_BUF_SIZE, 0))) > 0) {
+            if (rtnl_parse(buf, len, ifindex, r, &found))
+                break;
+        }
+    }
+    free(buf);
+    return found;
+}
+
+static void *dhcp_thread(void *arg)
+{
+    struct wifi_dhcp_result r;
+    wifi_dhcp_callback cb;
+    void *cb_arg;
+    uint64_t one = 1;
+    int rtnl_fd = -1;
+    int ifindex;
+
+    (void) arg;
+    memset(&r, 0, sizeof(r));
+
+    /* For test driver, always report success */
+    if (strcmp(primary_iface, WIFI_TEST_INTERFACE) == 0)
+        goto done;
+
+    /* Subscribe before the exchange so the address events aren't missed */
+    ifindex = if_nametoindex(primary_iface);
+    if (ifindex > 0)
+        rtnl_fd = open_rtnl_socket();
+
+    if (ifc_init() < 0 || do_dhcp(primary_iface) < 0) {
+        r.status = -1;
+        goto done;
+    }
+    /* DNS servers, the DHCP server and the lease only come from the client */
+    get_dhcp_info(&r.ipaddr, &r.gateway, &r.mask, &r.dns1, &r.dns2, &r.server, &r.lease);
+    if (rtnl_fd >= 0) {
+        struct wifi_dhcp_result nl = r;
+        int found = rtnl_read_config(rtnl_fd, ifindex, &nl);
+
+        if (found & DHCP_HAVE_ADDR) {
+            r.ipaddr = nl.ipaddr;
+            r.mask = nl.mask;
+        } else if (found & DHCP_NO_ADDR) {
+            /* the lease was lost before we got here */
+            r.status = -1;
+            r.ipaddr = 0;
+            r.mask = 0;
+        }
+        if (found & DHCP_HAVE_GW)
+            r.gateway = nl.gateway;
+    }
+
+done:
+    if (rtnl_fd >= 0)
+        close(rtnl_fd);
+
+    /*
+     * Publish the result and go idle before the callback runs, so the
+     * callback sees the same state a poller would and may call back in.
+     */
+    pthread_mutex_lock(&dhcp_lock);
+    dhcp_result = r;
+    dhcp_result_ready = 1;
+    cb = dhcp_cb;
+    cb_arg = dhcp_cb_arg;
+    dhcp_busy = 0;
+    pthread_cond_broadcast(&dhcp_idle_cond);
+    TEMP_FAILURE_RETRY(write(dhcp_event_fd, &one, sizeof(one)));
+    pthread_mutex_unlock(&dhcp_lock);
+
+    if (cb != NULL)
+        cb(&r, cb_arg);
+    return NULL;
+}
+
+int wifi_dhcp_get_fd()
+{
+    pthread_mutex_lock(&dhcp_lock);
+    if (dhcp_event_fd < 0)
+        dhcp_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_unlock(&dhcp_lock);
+    return dhcp_event_fd;
+}
+
+int wifi_dhcp_request_async(wifi_dhcp_callback callback, void *arg)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
+
+    if (wifi_dhcp_get_fd() < 0)
+        return -1;
+
+    pthread_mutex_lock(&dhcp_lock);
+    if (dhcp_busy) {
+        pthread_mutex_unlock(&dhcp_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    dhcp_busy = 1;
+    dhcp_result_ready = 0;
+    dhcp_cb = callback;
+    dhcp_cb_arg = arg;
+    /* the ifc socket stays open until wifi_dhcp_close() */
+    dhcp_ifc_held = 1;
+    pthread_mutex_unlock(&dhcp_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, dhcp_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        ALOGE("Cannot start DHCP thread: %s", strerror(ret));
+        pthread_mutex_lock(&dhcp_lock);
+        dhcp_busy = 0;
+        pthread_mutex_unlock(&dhcp_lock);
+        return -1;
+    }
+    return 0;
+}
+
+int wifi_dhcp_get_result(struct wifi_dhcp_result *result)
+{
+    uint64_t count;
+    int ret = -1;
+
+    if (dhcp_event_fd >= 0)
+        TEMP_FAILURE_RETRY(read(dhcp_event_fd, &count, sizeof(count)));
+    pthread_mutex_lock(&dhcp_lock);
+    if (dhcp_result_ready) {
+        *result = dhcp_result;
+        dhcp_result_ready = 0;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&dhcp_lock);
+    return ret;
+}
+
+void wifi_dhcp_close()
+{
+    pthread_mutex_lock(&dhcp_lock);
+    while (dhcp_busy)
+        pthread_cond_wait(&dhcp_idle_cond, &dhcp_lock);
+    if (dhcp_ifc_held) {
+        dhcp_ifc_held = 0;
+        ifc_close();
+    }
+    pthread_mutex_unlock(&dhcp_lock);
+}
+
 int is_wifi_driver_loaded() {
     char driver_status[PROPERTY_VALUE_MAX];
 #ifdef WIFI_DRIVER_MODULE_PATH1
@@ -221,7 +718,7 @@ int wifi_load_driver()
 {
 #ifdef WIFI_DRIVER_MODULE_PATH1
     char driver_status[PROPERTY_VALUE_MAX];
-    int count = 100; /* wait at most 20 seconds for completion */
+    struct state_wait w;
 
 	char node[50] = {'\0',};
     char buf[5] = {'\0',};
@@ -298,17 +795,17 @@ int wifi_load_driver()
         property_set("ctl.start", FIRMWARE_LOADER);
     }
     sched_yield();
-    while (count-- > 0) {
+    state_wait_begin(&w, 20000, NULL); /* wait at most 20 seconds for completion */
+    do {
         if (property_get(DRIVER_PROP_NAME, driver_status, NULL)) {
             if (strcmp(driver_status, "ok") == 0)
                 return 0;
-            else if (strcmp(DRIVER_PROP_NAME, "failed") == 0) {
+            else if (strcmp(driver_status, "failed") == 0) {
                 wifi_unload_driver();
                 return -1;
             }
         }
-        usleep(200000);
-    }
+    } while (state_wait_next(&w) == 0);
     property_set(DRIVER_PROP_NAME, "timeout");
     wifi_unload_driver();
     return -1;
@@ -386,41 +883,167 @@ int ensure_entropy_file_exists()
     return 0;
 }
 
+/*
+ * Signature of the last config file content known to carry the right
+ * ctrl_interface value. A supplicant restart with an unchanged file then
+ * costs a single stat(); a file that was touched but not modified costs a
+ * read-only mapping and a hash, and is never rewritten.
+ */
+struct config_file_state {
+    const char *path;
+    int valid;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    uint64_t ifc_hash;
+    uint64_t hash;
+};
+
+static struct config_file_state config_states[] = {
+    { SUPP_CONFIG_FILE, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { P2P_CONFIG_FILE,  0, 0, 0, 0, 0, 0, 0, 0 },
+};
+
+static struct config_file_state *find_config_state(const char *config_file)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(config_states) / sizeof(config_states[0]); i++) {
+        if (strcmp(config_states[i].path, config_file) == 0)
+            return &config_states[i];
+    }
+    return NULL;
+}
+
+static int config_state_matches(const struct config_file_state *cs,
+                                const struct stat *sb)
+{
+    return cs->valid && cs->dev == sb->st_dev && cs->ino == sb->st_ino &&
+            cs->size == sb->st_size && cs->mtime == sb->st_mtime &&
+            cs->ctime == sb->st_ctime;
+}
+
+static void config_state_save(struct config_file_state *cs, const struct stat *sb,
+                              uint64_t ifc_hash, uint64_t hash)
+{
+    cs->valid = 1;
+    cs->ifc_hash = ifc_hash;
+    cs->dev = sb->st_dev;
+    cs->ino = sb->st_ino;
+    cs->size = sb->st_size;
+    cs->mtime = sb->st_mtime;
+    cs->ctime = sb->st_ctime;
+    cs->hash = hash;
+}
+
+/* 64-bit FNV-1a, continued from 'hash' */
+static uint64_t fnv1a_hash(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len-- > 0) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define FNV1A_INIT	0xcbf29ce484222325ULL
+
+/*
+ * Writes 'iov' to a temporary file next to 'config_file', syncs it, sets
+ * its ownership and atomically renames it over 'config_file'.
+ */
+static int write_config_atomically(const char *config_file,
+                                   const struct iovec *iov, int iovcnt)
+{
+    char tmp_file[PATH_MAX];
+    ssize_t total = 0, nwrite;
+    int destfd, i;
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", config_file);
+    destfd = TEMP_FAILURE_RETRY(open(tmp_file, O_CREAT|O_TRUNC|O_WRONLY, 0660));
+    if (destfd < 0) {
+        ALOGE("Cannot create \"%s\": %s", tmp_file, strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    nwrite = TEMP_FAILURE_RETRY(writev(destfd, iov, iovcnt));
+    if (nwrite != total || fsync(destfd) != 0) {
+        ALOGE("Cannot write \"%s\": %s", tmp_file, strerror(errno));
+        close(destfd);
+        unlink(tmp_file);
+        return -1;
+    }
+    if (fchmod(destfd, 0660) < 0 || fchown(destfd, AID_SYSTEM, AID_WIFI) < 0) {
+        ALOGE("Error setting permissions of %s: %s", tmp_file, strerror(errno));
+        close(destfd);
+        unlink(tmp_file);
+        return -1;
+    }
+    close(destfd);
+    if (rename(tmp_file, config_file) < 0) {
+        ALOGE("Cannot replace \"%s\": %s", config_file, strerror(errno));
+        unlink(tmp_file);
+        return -1;
+    }
+    return 0;
+}
+
 int update_ctrl_interface(const char *config_file) {
 
-    int srcfd, destfd;
-    int nread;
+    int srcfd;
     char ifc[PROPERTY_VALUE_MAX];
     char *pbuf;
     char *sptr;
     struct stat sb;
+    struct config_file_state *cs;
+    uint64_t ifc_hash, hash;
+    size_t size;
     int ret;
 
+    if (!strcmp(config_file, SUPP_CONFIG_FILE)) {
+        property_get("wifi.interface", ifc, WIFI_TEST_INTERFACE);
+    } else {
+        strcpy(ifc, CONTROL_IFACE_PATH);
+    }
+
+    ifc_hash = fnv1a_hash(FNV1A_INIT, ifc, strlen(ifc));
+
     if (stat(config_file, &sb) != 0)
         return -1;
-
-    pbuf = malloc(sb.st_size + PROPERTY_VALUE_MAX);
-    if (!pbuf)
+    cs = find_config_state(config_file);
+    if (cs != NULL && config_state_matches(cs, &sb) && cs->ifc_hash == ifc_hash) {
+        /* unchanged since it was last checked */
         return 0;
+    }
+    if (sb.st_size <= 0)
+        return -1;
+    size = sb.st_size;
+
     srcfd = TEMP_FAILURE_RETRY(open(config_file, O_RDONLY));
     if (srcfd < 0) {
         ALOGE("Cannot open \"%s\": %s", config_file, strerror(errno));
-        free(pbuf);
         return 0;
     }
-    nread = TEMP_FAILURE_RETRY(read(srcfd, pbuf, sb.st_size));
+    pbuf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, srcfd, 0);
     close(srcfd);
-    if (nread < 0) {
-        ALOGE("Cannot read \"%s\": %s", config_file, strerror(errno));
-        free(pbuf);
+    if (pbuf == MAP_FAILED) {
+        ALOGE("Cannot map \"%s\": %s", config_file, strerror(errno));
         return 0;
     }
 
-    if (!strcmp(config_file, SUPP_CONFIG_FILE)) {
-        property_get("wifi.interface", ifc, WIFI_TEST_INTERFACE);
-    } else {
-        strcpy(ifc, CONTROL_IFACE_PATH);
+    hash = fnv1a_hash(fnv1a_hash(FNV1A_INIT, pbuf, size), ifc, strlen(ifc));
+    if (cs != NULL && cs->valid && cs->hash == hash) {
+        /* touched but not modified */
+        config_state_save(cs, &sb, ifc_hash, hash);
+        munmap(pbuf, size);
+        return 0;
     }
+
     /* Assume file is invalid to begin with */
     ret = -1;
     /*
@@ -433,43 +1056,85 @@ int update_ctrl_interface(const char *config_file) {
      * The <value> is deemed to be a directory if the "DIR=" form is used or
      * the value begins with "/".
      */
-    if ((sptr = strstr(pbuf, "ctrl_interface="))) {
+    if ((sptr = memmem(pbuf, size, "ctrl_interface=", strlen("ctrl_interface=")))) {
         ret = 0;
-        if ((!strstr(pbuf, "ctrl_interface=DIR=")) &&
-                (!strstr(pbuf, "ctrl_interface=/"))) {
+        if ((!memmem(pbuf, size, "ctrl_interface=DIR=", strlen("ctrl_interface=DIR="))) &&
+                (!memmem(pbuf, size, "ctrl_interface=/", strlen("ctrl_interface=/")))) {
             char *iptr = sptr + strlen("ctrl_interface=");
-            int ilen = 0;
-            int mlen = strlen(ifc);
-            int nwrite;
-            if (strncmp(ifc, iptr, mlen) != 0) {
+            size_t ilen = 0;
+            size_t mlen = strlen(ifc);
+            size_t remain = size - (iptr - pbuf);
+            if (remain < mlen || strncmp(ifc, iptr, mlen) != 0) {
+                struct iovec iov[3];
                 ALOGE("ctrl_interface != %s", ifc);
-                while (((ilen + (iptr - pbuf)) < nread) && (iptr[ilen] != '\n'))
+                while (ilen < remain && iptr[ilen] != '\n')
                     ilen++;
-                mlen = ((ilen >= mlen) ? ilen : mlen) + 1;
-                memmove(iptr + mlen, iptr + ilen + 1, nread - (iptr + ilen + 1 - pbuf));
-                memset(iptr, '\n', mlen);
-                memcpy(iptr, ifc, strlen(ifc));
-                destfd = TEMP_FAILURE_RETRY(open(config_file, O_RDWR, 0660));
-                if (destfd < 0) {
-                    ALOGE("Cannot update \"%s\": %s", config_file, strerror(errno));
-                    free(pbuf);
+                /* Splice the new value in place of the rest of the line */
+                iov[0].iov_base = pbuf;
+                iov[0].iov_len = iptr - pbuf;
+                iov[1].iov_base = ifc;
+                iov[1].iov_len = mlen;
+                iov[2].iov_base = iptr + ilen;
+                iov[2].iov_len = remain - ilen;
+                if (write_config_atomically(config_file, iov, 3) < 0) {
+                    munmap(pbuf, size);
                     return -1;
                 }
-                TEMP_FAILURE_RETRY(write(destfd, pbuf, nread + mlen - ilen -1));
-                close(destfd);
+                hash = fnv1a_hash(FNV1A_INIT, iov[0].iov_base, iov[0].iov_len);
+                hash = fnv1a_hash(hash, iov[1].iov_base, iov[1].iov_len);
+                hash = fnv1a_hash(hash, iov[2].iov_base, iov[2].iov_len);
+                hash = fnv1a_hash(hash, ifc, mlen);
+                if (stat(config_file, &sb) != 0)
+                    cs = NULL;
             }
         }
     }
-    free(pbuf);
+    munmap(pbuf, size);
+    if (cs != NULL) {
+        if (ret == 0)
+            config_state_save(cs, &sb, ifc_hash, hash);
+        else
+            cs->valid = 0;
+    }
     return ret;
 }
 
-int ensure_config_file_exists(const char *config_file)
+/*
+ * Copies 'size' bytes from 'srcfd' to 'destfd' in the kernel with sendfile(), falling back to a
+ * read/write loop where sendfile() can't be used between the two files.
+ */
+static int copy_file_contents(int srcfd, int destfd, off_t size)
 {
     char buf[2048];
+    off_t offset = 0;
+    ssize_t nread;
+
+    while (offset < size) {
+        nread = sendfile(destfd, srcfd, &offset, size - offset);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread < 0 && (errno == EINVAL || errno == ENOSYS) && offset == 0)
+            break;
+        if (nread <= 0)
+            return (nread < 0) ? -1 : 0;
+    }
+    if (offset > 0)
+        return 0;
+
+    while ((nread = TEMP_FAILURE_RETRY(read(srcfd, buf, sizeof(buf)))) != 0) {
+        if (nread < 0)
+            return -1;
+        if (TEMP_FAILURE_RETRY(write(destfd, buf, nread)) != nread)
+            return -1;
+    }
+    return 0;
+}
+
+int ensure_config_file_exists(const char *config_file)
+{
+    char tmp_file[PATH_MAX];
     int srcfd, destfd;
     struct stat sb;
-    int nread;
     int ret;
 
     ret = access(config_file, R_OK|W_OK);
@@ -497,75 +1162,96 @@ int ensure_config_file_exists(const char *config_file)
         ALOGE("Cannot open \"%s\": %s", SUPP_CONFIG_TEMPLATE, strerror(errno));
         return -1;
     }
+    if (fstat(srcfd, &sb) != 0) {
+        ALOGE("Cannot stat \"%s\": %s", SUPP_CONFIG_TEMPLATE, strerror(errno));
+        close(srcfd);
+        return -1;
+    }
 
-    destfd = TEMP_FAILURE_RETRY(open(config_file, O_CREAT|O_RDWR, 0660));
+    /* Build the copy next to the target and rename it into place */
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", config_file);
+    destfd = TEMP_FAILURE_RETRY(open(tmp_file, O_CREAT|O_TRUNC|O_WRONLY, 0660));
     if (destfd < 0) {
         close(srcfd);
-        ALOGE("Cannot create \"%s\": %s", config_file, strerror(errno));
+        ALOGE("Cannot create \"%s\": %s", tmp_file, strerror(errno));
         return -1;
     }
 
-    while ((nread = TEMP_FAILURE_RETRY(read(srcfd, buf, sizeof(buf)))) != 0) {
-        if (nread < 0) {
-            ALOGE("Error reading \"%s\": %s", SUPP_CONFIG_TEMPLATE, strerror(errno));
-            close(srcfd);
-            close(destfd);
-            unlink(config_file);
-            return -1;
-        }
-        TEMP_FAILURE_RETRY(write(destfd, buf, nread));
+    if (copy_file_contents(srcfd, destfd, sb.st_size) < 0 || fsync(destfd) != 0) {
+        ALOGE("Error copying \"%s\": %s", SUPP_CONFIG_TEMPLATE, strerror(errno));
+        close(srcfd);
+        close(destfd);
+        unlink(tmp_file);
+        return -1;
     }
 
     close(destfd);
     close(srcfd);
 
     /* chmod is needed because open() didn't set permisions properly */
-    if (chmod(config_file, 0660) < 0) {
+    if (chmod(tmp_file, 0660) < 0) {
         ALOGE("Error changing permissions of %s to 0660: %s",
-             config_file, strerror(errno));
-        unlink(config_file);
+             tmp_file, strerror(errno));
+        unlink(tmp_file);
         return -1;
     }
 
-    if (chown(config_file, AID_SYSTEM, AID_WIFI) < 0) {
+    if (chown(tmp_file, AID_SYSTEM, AID_WIFI) < 0) {
         ALOGE("Error changing group ownership of %s to %d: %s",
-             config_file, AID_WIFI, strerror(errno));
-        unlink(config_file);
+             tmp_file, AID_WIFI, strerror(errno));
+        unlink(tmp_file);
+        return -1;
+    }
+
+    if (rename(tmp_file, config_file) < 0) {
+        ALOGE("Cannot create \"%s\": %s", config_file, strerror(errno));
+        unlink(tmp_file);
         return -1;
     }
     return update_ctrl_interface(config_file);
 }
 
-int wifi_start_supplicant(int p2p_supported)
+/*
+ * Waits for property 'name' to read 'value'. Returns 0 once it does, or -1
+ * when 'w' runs out. Ends 'w' either way.
+ */
+static int wait_for_property(const char *name, const char *value, struct state_wait *w)
 {
-    char supp_status[PROPERTY_VALUE_MAX] = {'\0'};
-    int count = 200; /* wait at most 20 seconds for completion */
-#ifdef HAVE_LIBC_SYSTEM_PROPERTIES
-    const prop_info *pi;
-    unsigned serial = 0, i;
-#endif
+    char status[PROPERTY_VALUE_MAX] = {'\0'};
+    int ret = -1;
+
+    do {
+        if (property_get(name, status, NULL) && strcmp(status, value) == 0) {
+            ret = 0;
+            break;
+        }
+    } while (state_wait_next(w) == 0);
+    state_wait_end(w);
+    return ret;
+}
 
+static void select_supplicant(int p2p_supported)
+{
     if (p2p_supported) {
         strcpy(supplicant_name, P2P_SUPPLICANT_NAME);
         strcpy(supplicant_prop_name, P2P_PROP_NAME);
-
-        /* Ensure p2p config file is created */
-        if (ensure_config_file_exists(P2P_CONFIG_FILE) < 0) {
-            ALOGE("Failed to create a p2p config file");
-            return -1;
-        }
-
     } else {
         strcpy(supplicant_name, SUPPLICANT_NAME);
         strcpy(supplicant_prop_name, SUPP_PROP_NAME);
     }
+}
 
-    /* Check whether already running */
-    if (property_get(supplicant_name, supp_status, NULL)
-            && strcmp(supp_status, "running") == 0) {
-        return 0;
-    }
+static int is_supplicant_running()
+{
+    char supp_status[PROPERTY_VALUE_MAX] = {'\0'};
 
+    return property_get(supplicant_name, supp_status, NULL)
+            && strcmp(supp_status, "running") == 0;
+}
+
+/* Config and entropy files, and stale sockets; independent of the driver */
+static int prepare_supplicant_files()
+{
     /* Before starting the daemon, make sure its config file exists */
     if (ensure_config_file_exists(SUPP_CONFIG_FILE) < 0) {
         ALOGE("Wi-Fi will not be enabled");
@@ -578,11 +1264,19 @@ int wifi_start_supplicant(int p2p_supported)
 
     /* Clear out any stale socket files that might be left over. */
     wpa_ctrl_cleanup();
+    return 0;
+}
 
-    /* Reset sockets used for exiting from hung state */
-    exit_sockets[0] = exit_sockets[1] = -1;
-
+/* Starts the service selected by select_supplicant() and waits for it */
+static int launch_supplicant()
+{
+    char supp_status[PROPERTY_VALUE_MAX] = {'\0'};
+    struct state_wait w;
+    int ret = -1;
 #ifdef HAVE_LIBC_SYSTEM_PROPERTIES
+    const prop_info *pi;
+    unsigned serial = 0;
+
     /*
      * Get a reference to the status property, so we can distinguish
      * the case where it goes stopped => running => stopped (i.e.,
@@ -597,10 +1291,13 @@ int wifi_start_supplicant(int p2p_supported)
 #endif
     property_get("wifi.interface", primary_iface, WIFI_TEST_INTERFACE);
 
+    /* Watch before starting so the socket creation can't be missed */
+    state_wait_begin(&w, 20000, primary_iface); /* wait at most 20 seconds for completion */
+
     property_set("ctl.start", supplicant_name);
     sched_yield();
 
-    while (count-- > 0) {
+    do {
 #ifdef HAVE_LIBC_SYSTEM_PROPERTIES
         if (pi == NULL) {
             pi = __system_property_find(supplicant_prop_name);
@@ -608,35 +1305,54 @@ int wifi_start_supplicant(int p2p_supported)
         if (pi != NULL) {
             __system_property_read(pi, NULL, supp_status);
             if (strcmp(supp_status, "running") == 0) {
-                return 0;
+                ret = 0;
+                break;
             } else if (__system_property_serial(pi) != serial &&
                     strcmp(supp_status, "stopped") == 0) {
-                return -1;
+                break;
             }
         }
 #else
         if (property_get(supplicant_prop_name, supp_status, NULL)) {
-            if (strcmp(supp_status, "running") == 0)
-                return 0;
+            if (strcmp(supp_status, "running") == 0) {
+                ret = 0;
+                break;
+            }
         }
 #endif
-        usleep(100000);
+    } while (state_wait_next(&w) == 0);
+    state_wait_end(&w);
+    return ret;
+}
+
+int wifi_start_supplicant(int p2p_supported)
+{
+    select_supplicant(p2p_supported);
+
+    /* Ensure p2p config file is created */
+    if (p2p_supported && ensure_config_file_exists(P2P_CONFIG_FILE) < 0) {
+        ALOGE("Failed to create a p2p config file");
+        return -1;
     }
-    return -1;
+
+    /* Check whether already running */
+    if (is_supplicant_running()) {
+        return 0;
+    }
+
+    if (prepare_supplicant_files() < 0)
+        return -1;
+
+    return launch_supplicant();
 }
 
 int wifi_stop_supplicant(int p2p_supported)
 {
     char supp_status[PROPERTY_VALUE_MAX] = {'\0'};
-    int count = 50; /* wait at most 5 seconds for completion */
+    char iface[PROPERTY_VALUE_MAX];
+    struct state_wait w;
 
-    if (p2p_supported) {
-        strcpy(supplicant_name, P2P_SUPPLICANT_NAME);
-        strcpy(supplicant_prop_name, P2P_PROP_NAME);
-    } else {
-        strcpy(supplicant_name, SUPPLICANT_NAME);
-        strcpy(supplicant_prop_name, SUPP_PROP_NAME);
-    }
+    select_supplicant(p2p_supported);
 
     /* Check whether supplicant already stopped */
     if (property_get(supplicant_prop_name, supp_status, NULL)
@@ -644,23 +1360,130 @@ int wifi_stop_supplicant(int p2p_supported)
         return 0;
     }
 
+    property_get("wifi.interface", iface, WIFI_TEST_INTERFACE);
+    state_wait_begin(&w, 5000, iface); /* wait at most 5 seconds for completion */
     property_set("ctl.stop", supplicant_name);
     sched_yield();
 
-    while (count-- > 0) {
-        if (property_get(supplicant_prop_name, supp_status, NULL)) {
-            if (strcmp(supp_status, "stopped") == 0)
-                return 0;
-        }
-        usleep(100000);
-    }
+    if (wait_for_property(supplicant_prop_name, "stopped", &w) == 0)
+        return 0;
     ALOGE("Failed to stop supplicant");
     return -1;
 }
 
-int wifi_connect_on_socket_path(const char *path)
+/* Must be called with iface_conns_lock held */
+static struct wifi_iface_conn *find_iface_conn(const char *ifname)
+{
+    int i;
+
+    for (i = 0; i < WIFI_MAX_IFACES; i++) {
+        if (iface_conns[i].in_use && strcmp(iface_conns[i].name, ifname) == 0)
+            return &iface_conns[i];
+    }
+    return NULL;
+}
+
+/* Must be called with iface_conns_lock held */
+static int ensure_monitor_epoll()
+{
+    struct epoll_event ev;
+
+    if (monitor_epfd >= 0)
+        return 0;
+
+    monitor_epfd = epoll_create(WIFI_MONITOR_MAX_EVENTS);
+    if (monitor_epfd < 0) {
+        ALOGE("Unable to create supplicant monitor epoll set: %s", strerror(errno));
+        return -1;
+    }
+    exit_event_fd = eventfd(0, 0);
+    if (exit_event_fd < 0) {
+        ALOGE("Unable to create supplicant exit eventfd: %s", strerror(errno));
+        close(monitor_epfd);
+        monitor_epfd = -1;
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = MONITOR_EXIT_KEY;
+    if (epoll_ctl(monitor_epfd, EPOLL_CTL_ADD, exit_event_fd, &ev) < 0) {
+        ALOGE("Unable to watch supplicant exit eventfd: %s", strerror(errno));
+        close(exit_event_fd);
+        exit_event_fd = -1;
+        close(monitor_epfd);
+        monitor_epfd = -1;
+        return -1;
+    }
+    exit_signalled = 0;
+    monitor_nevents = monitor_next = 0;
+    return 0;
+}
+
+/* Must be called with iface_conns_lock held */
+static void signal_monitor_exit()
+{
+    exit_signalled = 1;
+    if (exit_event_fd >= 0)
+        eventfd_write(exit_event_fd, 1);
+}
+
+static uint64_t monitor_key(struct wifi_iface_conn *conn)
+{
+    return ((uint64_t)conn->gen << 32) | (uint64_t)(conn - iface_conns + 1);
+}
+
+/* Must be called with iface_conns_lock held */
+static struct wifi_iface_conn *monitor_conn_from_key(uint64_t key)
+{
+    unsigned int idx = (unsigned int)(key & 0xffffffff) - 1;
+    struct wifi_iface_conn *conn;
+
+    if (idx >= WIFI_MAX_IFACES)
+        return NULL;
+    conn = &iface_conns[idx];
+    if (!conn->in_use || conn->gen != (unsigned int)(key >> 32))
+        return NULL;
+    return conn;
+}
+
+/* Must be called with iface_conns_lock held */
+static void close_iface_conn_locked(struct wifi_iface_conn *conn)
+{
+    int i;
+
+    /* Fail new command attempts, then wait for the in-flight ones */
+    conn->in_use = 0;
+    for (;;) {
+        int busy = conn->monitor_reading;
+        for (i = 0; i < WIFI_CTRL_POOL_SIZE; i++) {
+            if (conn->ctrl_state[i] == CTRL_SLOT_BUSY)
+                busy = 1;
+        }
+        if (!busy)
+            break;
+        pthread_cond_wait(&conn_state_cond, &iface_conns_lock);
+    }
+
+    for (i = 0; i < WIFI_CTRL_POOL_SIZE; i++) {
+        if (conn->ctrl_pool[i] != NULL)
+            wpa_ctrl_close(conn->ctrl_pool[i]);
+    }
+    if (conn->monitor_conn != NULL) {
+        if (monitor_epfd >= 0)
+            epoll_ctl(monitor_epfd, EPOLL_CTL_DEL,
+                      wpa_ctrl_get_fd(conn->monitor_conn), NULL);
+        wpa_ctrl_close(conn->monitor_conn);
+    }
+    memset(conn, 0, sizeof(*conn));
+}
+
+static int wifi_connect_iface_on_socket_path(const char *ifname, const char *path)
 {
     char supp_status[PROPERTY_VALUE_MAX] = {'\0'};
+    struct wpa_ctrl *ctrl, *monitor;
+    struct wifi_iface_conn *conn = NULL;
+    struct epoll_event ev;
+    int i;
 
     /* Make sure supplicant is running */
     if (!property_get(supplicant_prop_name, supp_status, NULL)
@@ -669,60 +1492,434 @@ int wifi_connect_on_socket_path(const char *path)
         return -1;
     }
 
-    ctrl_conn = wpa_ctrl_open(path);
-    if (ctrl_conn == NULL) {
+    ctrl = wpa_ctrl_open(path);
+    if (ctrl == NULL) {
         ALOGE("Unable to open connection to supplicant on \"%s\": %s",
              path, strerror(errno));
         return -1;
     }
-    monitor_conn = wpa_ctrl_open(path);
-    if (monitor_conn == NULL) {
-        wpa_ctrl_close(ctrl_conn);
-        ctrl_conn = NULL;
+    monitor = wpa_ctrl_open(path);
+    if (monitor == NULL) {
+        wpa_ctrl_close(ctrl);
+        return -1;
+    }
+    if (wpa_ctrl_attach(monitor) != 0) {
+        wpa_ctrl_close(monitor);
+        wpa_ctrl_close(ctrl);
         return -1;
     }
-    if (wpa_ctrl_attach(monitor_conn) != 0) {
-        wpa_ctrl_close(monitor_conn);
-        wpa_ctrl_close(ctrl_conn);
-        ctrl_conn = monitor_conn = NULL;
+
+    pthread_mutex_lock(&iface_conns_lock);
+    if ((conn = find_iface_conn(ifname)) != NULL)
+        close_iface_conn_locked(conn);
+    for (i = 0; i < WIFI_MAX_IFACES; i++) {
+        if (!iface_conns[i].in_use) {
+            conn = &iface_conns[i];
+            break;
+        }
+    }
+    if (conn == NULL || ensure_monitor_epoll() < 0) {
+        if (conn == NULL)
+            ALOGE("Too many supplicant interfaces, cannot connect %s", ifname);
+        pthread_mutex_unlock(&iface_conns_lock);
+        wpa_ctrl_close(monitor);
+        wpa_ctrl_close(ctrl);
         return -1;
     }
 
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, exit_sockets) == -1) {
-        wpa_ctrl_close(monitor_conn);
-        wpa_ctrl_close(ctrl_conn);
-        ctrl_conn = monitor_conn = NULL;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    conn->gen = ++iface_conn_gen;
+    ev.data.u64 = monitor_key(conn);
+    if (epoll_ctl(monitor_epfd, EPOLL_CTL_ADD, wpa_ctrl_get_fd(monitor), &ev) < 0) {
+        ALOGE("Unable to watch monitor socket for %s: %s", ifname, strerror(errno));
+        pthread_mutex_unlock(&iface_conns_lock);
+        wpa_ctrl_close(monitor);
+        wpa_ctrl_close(ctrl);
         return -1;
     }
 
+    strlcpy(conn->name, ifname, sizeof(conn->name));
+    strlcpy(conn->path, path, sizeof(conn->path));
+    conn->ctrl_pool[0] = ctrl;
+    conn->ctrl_state[0] = CTRL_SLOT_IDLE;
+    conn->monitor_conn = monitor;
+    conn->in_use = 1;
+    pthread_mutex_unlock(&iface_conns_lock);
+
     return 0;
 }
 
-/* Establishes the control and monitor socket connections on the interface */
-int wifi_connect_to_supplicant()
+int wifi_connect_on_socket_path(const char *path)
+{
+    return wifi_connect_iface_on_socket_path(primary_iface, path);
+}
+
+static int wifi_connect_iface(const char *ifname)
 {
-    static char path[PATH_MAX];
+    char path[PATH_MAX];
 
     if (access(IFACE_DIR, F_OK) == 0) {
-        snprintf(path, sizeof(path), "%s/%s", IFACE_DIR, primary_iface);
+        snprintf(path, sizeof(path), "%s/%s", IFACE_DIR, ifname);
     } else {
-        snprintf(path, sizeof(path), "@android:wpa_%s", primary_iface);
+        snprintf(path, sizeof(path), "@android:wpa_%s", ifname);
     }
-    return wifi_connect_on_socket_path(path);
+    return wifi_connect_iface_on_socket_path(ifname, path);
 }
 
-int wifi_send_command(const char *cmd, char *reply, size_t *reply_len)
+/* Establishes the control and monitor socket connections on the interface */
+int wifi_connect_to_supplicant()
+{
+    return wifi_connect_iface(primary_iface);
+}
+
+int wifi_connect_iface_to_supplicant(const char *ifname)
+{
+    return wifi_connect_iface(ifname);
+}
+
+struct startup_prep {
+    int p2p_supported;
+    int result;
+    int64_t elapsed_ms;
+};
+
+static void *startup_prep_thread(void *arg)
+{
+    struct startup_prep *prep = arg;
+    int64_t start = wifi_now_ms();
+
+    prep->result = 0;
+    if (prep->p2p_supported && ensure_config_file_exists(P2P_CONFIG_FILE) < 0) {
+        ALOGE("Failed to create a p2p config file");
+        prep->result = -1;
+    } else if (!is_supplicant_running()) {
+        prep->result = prepare_supplicant_files();
+    }
+    prep->elapsed_ms = wifi_now_ms() - start;
+    return NULL;
+}
+
+int wifi_start_pipelined(int p2p_supported, struct wifi_startup_timing *timing)
+{
+    struct wifi_startup_timing t;
+    struct startup_prep prep;
+    pthread_t prep_thread;
+    char path[PATH_MAX];
+    char iface[PROPERTY_VALUE_MAX];
+    int64_t start, stage;
+    int prep_threaded;
+    struct state_wait w;
+    int ret;
+
+    memset(&t, 0, sizeof(t));
+    start = wifi_now_ms();
+    select_supplicant(p2p_supported);
+
+    /* File preparation runs while the module and firmware load */
+    prep.p2p_supported = p2p_supported;
+    prep_threaded = pthread_create(&prep_thread, NULL, startup_prep_thread, &prep) == 0;
+    if (!prep_threaded)
+        startup_prep_thread(&prep);
+
+    stage = wifi_now_ms();
+    ret = wifi_load_driver();
+    t.driver_load_ms = wifi_now_ms() - stage;
+
+    if (prep_threaded)
+        pthread_join(prep_thread, NULL);
+    t.file_prep_ms = prep.elapsed_ms;
+    if (ret < 0 || prep.result < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    stage = wifi_now_ms();
+    if (!is_supplicant_running() && launch_supplicant() < 0) {
+        ret = -1;
+        goto out;
+    }
+    t.supplicant_start_ms = wifi_now_ms() - stage;
+
+    /* Connect as soon as the control socket shows up */
+    stage = wifi_now_ms();
+    property_get("wifi.interface", iface, WIFI_TEST_INTERFACE);
+    state_wait_begin(&w, 5000, iface);
+    if (w.watch_fd >= 0) {
+        snprintf(path, sizeof(path), "%s/%s", IFACE_DIR, iface);
+        while (access(path, F_OK) != 0 && state_wait_next(&w) == 0)
+            ;
+    }
+    state_wait_end(&w);
+    ret = wifi_connect_to_supplicant();
+    t.connect_ms = wifi_now_ms() - stage;
+
+out:
+    t.total_ms = wifi_now_ms() - start;
+    ALOGD("Wi-Fi startup %s: driver %lld ms, files %lld ms (overlapped), "
+          "supplicant %lld ms, connect %lld ms, total %lld ms",
+          ret == 0 ? "done" : "failed",
+          (long long)t.driver_load_ms, (long long)t.file_prep_ms,
+          (long long)t.supplicant_start_ms, (long long)t.connect_ms,
+          (long long)t.total_ms);
+    if (timing != NULL)
+        *timing = t;
+    return ret;
+}
+
+/*
+ * Takes a control connection for 'ifname' out of its pool, opening a new
+ * one if all open connections are busy and the pool isn't full yet. If
+ * that open fails, waits for an open one to come free instead; a later
+ * call tries to grow the pool again. Returns NULL if the interface isn't
+ * connected or has no connection at all.
+ */
+static struct wpa_ctrl *ctrl_conn_get(const char *ifname,
+                                      struct wifi_iface_conn **pconn, int *pslot)
+{
+    struct wifi_iface_conn *conn;
+    struct wpa_ctrl *ctrl;
+    int i, nopen, empty;
+    int grow = 1;
+
+    pthread_mutex_lock(&iface_conns_lock);
+    for (;;) {
+        conn = find_iface_conn(ifname);
+        if (conn == NULL) {
+            pthread_mutex_unlock(&iface_conns_lock);
+            return NULL;
+        }
+        nopen = 0;
+        empty = -1;
+        for (i = 0; i < WIFI_CTRL_POOL_SIZE; i++) {
+            if (conn->ctrl_state[i] == CTRL_SLOT_IDLE) {
+                conn->ctrl_state[i] = CTRL_SLOT_BUSY;
+                ctrl = conn->ctrl_pool[i];
+                pthread_mutex_unlock(&iface_conns_lock);
+                *pconn = conn;
+                *pslot = i;
+                return ctrl;
+            }
+            if (conn->ctrl_state[i] == CTRL_SLOT_EMPTY) {
+                if (empty < 0)
+                    empty = i;
+            } else {
+                nopen++;
+            }
+        }
+        if (empty >= 0 && grow) {
+            /* Reserve the slot and open the connection without the lock */
+            conn->ctrl_state[empty] = CTRL_SLOT_BUSY;
+            pthread_mutex_unlock(&iface_conns_lock);
+            ctrl = wpa_ctrl_open(conn->path);
+            pthread_mutex_lock(&iface_conns_lock);
+            if (ctrl != NULL) {
+                conn->ctrl_pool[empty] = ctrl;
+                pthread_mutex_unlock(&iface_conns_lock);
+                *pconn = conn;
+                *pslot = empty;
+                return ctrl;
+            }
+            ALOGW("Unable to grow control pool for %s: %s", ifname, strerror(errno));
+            conn->ctrl_state[empty] = CTRL_SLOT_EMPTY;
+            grow = 0;
+            pthread_cond_broadcast(&conn_state_cond);
+            continue;
+        }
+        if (nopen == 0) {
+            pthread_mutex_unlock(&iface_conns_lock);
+            return NULL;
+        }
+        pthread_cond_wait(&conn_state_cond, &iface_conns_lock);
+    }
+}
+
+static void ctrl_conn_put(struct wifi_iface_conn *conn, int slot)
+{
+    pthread_mutex_lock(&iface_conns_lock);
+    conn->ctrl_state[slot] = CTRL_SLOT_IDLE;
+    pthread_cond_broadcast(&conn_state_cond);
+    pthread_mutex_unlock(&iface_conns_lock);
+}
+
+/*
+ * Per-verb command latency statistics, updated with atomic operations
+ * only so that recording never contends with the command path. Latencies
+ * are bucketed log-linearly in microseconds: values below 4 us get one
+ * bucket each, then every power of two is split into 4 linear buckets.
+ */
+static const char *cmd_verbs[] = {
+    "PING", "SCAN", "SCAN_RESULTS", "BSS", "STATUS", "LIST_NETWORKS",
+    "ADD_NETWORK", "SET_NETWORK", "GET_NETWORK", "ENABLE_NETWORK",
+    "DISABLE_NETWORK", "SELECT_NETWORK", "REMOVE_NETWORK", "SAVE_CONFIG",
+    "RECONNECT", "REASSOCIATE", "DISCONNECT", "SIGNAL_POLL", "DRIVER",
+    "SET", "GET", "WPS_PBC", "WPS_PIN", "P2P_FIND", "P2P_STOP_FIND",
+    "P2P_CONNECT", "P2P_GROUP_ADD", "P2P_GROUP_REMOVE", "P2P_PEER",
+    "P2P_SERV_DISC_REQ",
+};
+#define CMD_VERB_COUNT		(sizeof(cmd_verbs) / sizeof(cmd_verbs[0]))
+#define CMD_VERB_OTHER		CMD_VERB_COUNT
+
+static struct wifi_cmd_stats cmd_stats[CMD_VERB_COUNT + 1];
+
+static int64_t wifi_now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int cmd_verb_index(const char *verb, size_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < CMD_VERB_COUNT; i++) {
+        if (strlen(cmd_verbs[i]) == len && memcmp(cmd_verbs[i], verb, len) == 0)
+            return i;
+    }
+    return CMD_VERB_OTHER;
+}
+
+static struct wifi_cmd_stats *cmd_stats_for(const char *cmd)
+{
+    const char *end;
+
+    /* skip the "IFNAME=iface " prefix */
+    if (strncmp(cmd, IFNAME, IFNAMELEN) == 0) {
+        end = strchr(cmd, ' ');
+        if (end != NULL)
+            cmd = end + 1;
+    }
+    end = cmd;
+    while (*end != '\0' && *end != ' ')
+        end++;
+    return &cmd_stats[cmd_verb_index(cmd, end - cmd)];
+}
+
+static int cmd_hist_bucket(uint32_t us)
+{
+    int msb, bucket;
+
+    if (us < 4)
+        return us;
+    msb = 31 - __builtin_clz(us);
+    bucket = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+    return bucket < WIFI_CMD_HIST_BUCKETS ? bucket : WIFI_CMD_HIST_BUCKETS - 1;
+}
+
+uint32_t wifi_cmd_hist_bucket_us(int bucket)
 {
+    if (bucket < 4)
+        return bucket;
+    return (uint32_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+static void cmd_stats_record(struct wifi_cmd_stats *st, int64_t elapsed_us, int ret)
+{
+    uint32_t us = elapsed_us > 0xffffffff ? 0xffffffff : (uint32_t)elapsed_us;
+    uint32_t max;
+
+    __sync_fetch_and_add(&st->count, 1);
+    __sync_fetch_and_add(&st->total_us, (uint64_t)us);
+    __sync_fetch_and_add(&st->buckets[cmd_hist_bucket(us)], 1);
+    if (ret == -2)
+        __sync_fetch_and_add(&st->timeouts, 1);
+    else if (ret < 0)
+        __sync_fetch_and_add(&st->failures, 1);
+    while ((max = st->max_us) < us &&
+            !__sync_bool_compare_and_swap(&st->max_us, max, us))
+        ;
+    __sync_fetch_and_sub(&st->in_flight, 1);
+}
+
+int wifi_get_command_stats(const char *verb, struct wifi_cmd_stats *stats)
+{
+    unsigned int idx;
+
+    if (verb == NULL)
+        idx = CMD_VERB_OTHER;
+    else if ((idx = cmd_verb_index(verb, strlen(verb))) == CMD_VERB_OTHER)
+        return -1;
+    /* counters are read individually, not as an atomic snapshot */
+    __sync_synchronize();
+    memcpy(stats, &cmd_stats[idx], sizeof(*stats));
+    return 0;
+}
+
+static uint32_t cmd_stats_percentile(const struct wifi_cmd_stats *st, int pct)
+{
+    uint64_t target = ((uint64_t)st->count * pct + 99) / 100;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < WIFI_CMD_HIST_BUCKETS; i++) {
+        seen += st->buckets[i];
+        if (seen >= target)
+            return wifi_cmd_hist_bucket_us(i);
+    }
+    return st->max_us;
+}
+
+int wifi_dump_command_stats(char *buf, size_t len)
+{
+    struct wifi_cmd_stats st;
+    size_t off = 0;
+    unsigned int i;
+    int n;
+
+    if (len == 0)
+        return 0;
+    buf[0] = '\0';
+    for (i = 0; i <= CMD_VERB_COUNT && off < len; i++) {
+        wifi_get_command_stats(i < CMD_VERB_COUNT ? cmd_verbs[i] : NULL, &st);
+        if (st.count == 0 && st.in_flight == 0)
+            continue;
+        n = snprintf(buf + off, len - off,
+                     "%s: count=%u in_flight=%u timeouts=%u failures=%u "
+                     "avg=%lluus p50>=%uus p90>=%uus p99>=%uus max=%uus\n",
+                     i < CMD_VERB_COUNT ? cmd_verbs[i] : "OTHER",
+                     st.count, st.in_flight, st.timeouts, st.failures,
+                     st.count ? (unsigned long long)(st.total_us / st.count) : 0ULL,
+                     cmd_stats_percentile(&st, 50), cmd_stats_percentile(&st, 90),
+                     cmd_stats_percentile(&st, 99), st.max_us);
+        if (n < 0)
+            break;
+        off += n;
+    }
+    return off < len ? (int)off : (int)len - 1;
+}
+
+static int wifi_send_iface_command(const char *ifname, const char *cmd,
+                                   char *reply, size_t *reply_len)
+{
+    struct wifi_iface_conn *conn;
+    struct wifi_cmd_stats *st;
+    struct wpa_ctrl *ctrl;
+    int64_t start;
+    int slot;
     int ret;
-    if (ctrl_conn == NULL) {
+
+    ctrl = ctrl_conn_get(ifname, &conn, &slot);
+    if (ctrl == NULL) {
         ALOGV("Not connected to wpa_supplicant - \"%s\" command dropped.\n", cmd);
         return -1;
     }
-    ret = wpa_ctrl_request(ctrl_conn, cmd, strlen(cmd), reply, reply_len, NULL);
+    st = cmd_stats_for(cmd);
+    __sync_fetch_and_add(&st->in_flight, 1);
+    start = wifi_now_us();
+    ret = wpa_ctrl_request(ctrl, cmd, strlen(cmd), reply, reply_len, NULL);
+    cmd_stats_record(st, wifi_now_us() - start,
+                     (ret == 0 && strncmp(reply, "FAIL", 4) == 0) ? -1 : ret);
     if (ret == -2) {
         ALOGD("'%s' command timed out.\n", cmd);
         /* unblocks the monitor receive socket for termination */
-        TEMP_FAILURE_RETRY(write(exit_sockets[0], "T", 1));
+        pthread_mutex_lock(&iface_conns_lock);
+        signal_monitor_exit();
+        pthread_mutex_unlock(&iface_conns_lock);
+    }
+    ctrl_conn_put(conn, slot);
+    if (ret == -2) {
         return -2;
     } else if (ret < 0 || strncmp(reply, "FAIL", 4) == 0) {
         return -1;
@@ -733,30 +1930,101 @@ int wifi_send_command(const char *cmd, char *reply, size_t *reply_len)
     return 0;
 }
 
-int wifi_ctrl_recv(char *reply, size_t *reply_len)
+int wifi_send_command(const char *cmd, char *reply, size_t *reply_len)
 {
-    int res;
-    int ctrlfd = wpa_ctrl_get_fd(monitor_conn);
-    struct pollfd rfds[2];
+    return wifi_send_iface_command(primary_iface, cmd, reply, reply_len);
+}
 
-    memset(rfds, 0, 2 * sizeof(struct pollfd));
-    rfds[0].fd = ctrlfd;
-    rfds[0].events |= POLLIN;
-    rfds[1].fd = exit_sockets[1];
-    rfds[1].events |= POLLIN;
-    res = TEMP_FAILURE_RETRY(poll(rfds, 2, -1));
-    if (res < 0) {
-        ALOGE("Error poll = %d", res);
-        return res;
+/*
+ * Waits for an event on any connected interface. On success, the name of
+ * the interface the event was received on is copied to 'ifname', which
+ * holds PROPERTY_VALUE_MAX bytes; the connection itself may be closed as
+ * soon as this returns. Returns -2 once the exit eventfd has been
+ * signalled or the connection is closed.
+ */
+static int wifi_ctrl_recv(char *reply, size_t *reply_len, char *ifname)
+{
+    struct wifi_iface_conn *conn;
+    uint64_t key;
+    ssize_t nread;
+    int epfd, fd, res;
+
+    pthread_mutex_lock(&monitor_wait_lock);
+    pthread_mutex_lock(&iface_conns_lock);
+    if (monitor_epfd < 0) {
+        pthread_mutex_unlock(&iface_conns_lock);
+        pthread_mutex_unlock(&monitor_wait_lock);
+        return -2;
     }
-    if (rfds[0].revents & POLLIN) {
-        return wpa_ctrl_recv(monitor_conn, reply, reply_len);
+    epfd = monitor_epfd;
+    monitor_waiters++;
+
+    for (;;) {
+        if (exit_signalled) {
+            res = -2;
+            break;
+        }
+        if (monitor_next >= monitor_nevents) {
+            pthread_mutex_unlock(&iface_conns_lock);
+            res = TEMP_FAILURE_RETRY(epoll_wait(epfd, monitor_events,
+                                                WIFI_MONITOR_MAX_EVENTS, -1));
+            pthread_mutex_lock(&iface_conns_lock);
+            if (res < 0) {
+                ALOGE("Error epoll_wait = %d", res);
+                monitor_nevents = monitor_next = 0;
+                break;
+            }
+            monitor_nevents = res;
+            monitor_next = 0;
+            continue;
+        }
+
+        key = monitor_events[monitor_next].data.u64;
+        if (key == MONITOR_EXIT_KEY) {
+            res = -2;
+            break;
+        }
+        conn = monitor_conn_from_key(key);
+        if (conn == NULL) {
+            /* interface closed since epoll_wait() reported it */
+            monitor_next++;
+            continue;
+        }
+
+        /*
+         * wpa_ctrl_recv() is a plain blocking recv(); read the socket
+         * directly so it can be drained without blocking.
+         */
+        conn->monitor_reading = 1;
+        fd = wpa_ctrl_get_fd(conn->monitor_conn);
+        pthread_mutex_unlock(&iface_conns_lock);
+        nread = TEMP_FAILURE_RETRY(recv(fd, reply, *reply_len, MSG_DONTWAIT));
+        pthread_mutex_lock(&iface_conns_lock);
+        conn->monitor_reading = 0;
+        pthread_cond_broadcast(&conn_state_cond);
+
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* drained; move on to the next ready socket */
+            monitor_next++;
+            continue;
+        }
+        if (nread < 0) {
+            monitor_next++;
+            res = -1;
+            break;
+        }
+        /* leave the socket current: more events may already be queued */
+        *reply_len = nread;
+        strlcpy(ifname, conn->name, PROPERTY_VALUE_MAX);
+        res = 0;
+        break;
     }
 
-    /* it is not rfds[0], then it must be rfts[1] (i.e. the exit socket)
-     * or we timed out. In either case, this call has failed ..
-     */
-    return -2;
+    monitor_waiters--;
+    pthread_cond_broadcast(&conn_state_cond);
+    pthread_mutex_unlock(&iface_conns_lock);
+    pthread_mutex_unlock(&monitor_wait_lock);
+    return res;
 }
 
 int wifi_wait_on_socket(char *buf, size_t buflen)
@@ -764,12 +2032,9 @@ int wifi_wait_on_socket(char *buf, size_t buflen)
     size_t nread = buflen - 1;
     int result;
     char *match, *match2;
+    char ifname[PROPERTY_VALUE_MAX];
 
-    if (monitor_conn == NULL) {
-        return snprintf(buf, buflen, WPA_EVENT_TERMINATING " - connection closed");
-    }
-
-    result = wifi_ctrl_recv(buf, &nread);
+    result = wifi_ctrl_recv(buf, &nread, ifname);
 
     /* Terminate reception on exit socket */
     if (result == -2) {
@@ -787,6 +2052,20 @@ int wifi_wait_on_socket(char *buf, size_t buflen)
         ALOGD("Received EOF on supplicant socket\n");
         return snprintf(buf, buflen, WPA_EVENT_TERMINATING " - signal 0 received");
     }
+    /*
+     * Events from secondary interfaces without a global control interface
+     * carry no IFNAME= prefix; add one so the caller can tell them apart.
+     */
+    if (strncmp(buf, IFNAME, IFNAMELEN) != 0 && strcmp(ifname, primary_iface) != 0) {
+        size_t plen = IFNAMELEN + strlen(ifname) + 1;
+        if (nread + plen < buflen) {
+            memmove(buf + plen, buf, nread + 1);
+            memcpy(buf, IFNAME, IFNAMELEN);
+            memcpy(buf + IFNAMELEN, ifname, plen - IFNAMELEN - 1);
+            buf[plen - 1] = ' ';
+            nread += plen;
+        }
+    }
     /*
      * Events strings are in the format
      *
@@ -832,48 +2111,445 @@ int wifi_wait_for_event(char *buf, size_t buflen)
     return wifi_wait_on_socket(buf, buflen);
 }
 
-void wifi_close_sockets()
+/*
+ * Perfect hash over the known event names: every name below maps to a
+ * distinct slot of event_names[], so classification is one hash, one
+ * length compare and one memcmp. Re-check for collisions when adding
+ * names.
+ */
+#define WIFI_EVENT_HASH_SIZE	64
+
+struct wifi_event_name {
+    const char *name;
+    size_t len;
+    int type;
+};
+
+static const struct wifi_event_name event_names[WIFI_EVENT_HASH_SIZE] = {
+    [ 0] = { "P2P-GROUP-FORMATION-FAILURE", 27, WIFI_EVENT_P2P_GROUP_FORMATION_FAILURE },
+    [ 1] = { "P2P-GROUP-REMOVED", 17, WIFI_EVENT_P2P_GROUP_REMOVED },
+    [ 2] = { "P2P-GO-NEG-SUCCESS", 18, WIFI_EVENT_P2P_GO_NEG_SUCCESS },
+    [ 3] = { "WPS-FAIL", 8, WIFI_EVENT_WPS_FAIL },
+    [ 4] = { "P2P-GROUP-STARTED", 17, WIFI_EVENT_P2P_GROUP_STARTED },
+    [ 5] = { "P2P-PROV-DISC-PBC-RESP", 22, WIFI_EVENT_P2P_PROV_DISC_PBC_RESP },
+    [ 9] = { "P2P-INVITATION-RECEIVED", 23, WIFI_EVENT_P2P_INVITATION_RECEIVED },
+    [11] = { "P2P-GO-NEG-FAILURE", 18, WIFI_EVENT_P2P_GO_NEG_FAILURE },
+    [13] = { "CTRL-EVENT-LINK-SPEED", 21, WIFI_EVENT_LINK_SPEED },
+    [17] = { "P2P-SERV-DISC-RESP", 18, WIFI_EVENT_P2P_SERV_DISC_RESP },
+    [19] = { "P2P-PROV-DISC-PBC-REQ", 21, WIFI_EVENT_P2P_PROV_DISC_PBC_REQ },
+    [20] = { "P2P-GO-NEG-REQUEST", 18, WIFI_EVENT_P2P_GO_NEG_REQUEST },
+    [22] = { "CTRL-EVENT-EAP-FAILURE", 22, WIFI_EVENT_EAP_FAILURE },
+    [23] = { "CTRL-EVENT-IGNORE", 17, WIFI_EVENT_IGNORE },
+    [24] = { "CTRL-EVENT-STATE-CHANGE", 23, WIFI_EVENT_STATE_CHANGE },
+    [26] = { "CTRL-EVENT-DISCONNECTED", 23, WIFI_EVENT_DISCONNECTED },
+    [28] = { "WPS-OVERLAP-DETECTED", 20, WIFI_EVENT_WPS_OVERLAP_DETECTED },
+    [30] = { "CTRL-EVENT-TERMINATING", 22, WIFI_EVENT_TERMINATING },
+    [32] = { "P2P-PROV-DISC-SHOW-PIN", 22, WIFI_EVENT_P2P_PROV_DISC_SHOW_PIN },
+    [33] = { "CTRL-EVENT-ASSOC-REJECT", 23, WIFI_EVENT_ASSOC_REJECT },
+    [36] = { "P2P-DEVICE-LOST", 15, WIFI_EVENT_P2P_DEVICE_LOST },
+    [37] = { "AP-STA-DISCONNECTED", 19, WIFI_EVENT_AP_STA_DISCONNECTED },
+    [39] = { "WPS-SUCCESS", 11, WIFI_EVENT_WPS_SUCCESS },
+    [41] = { "WPS-TIMEOUT", 11, WIFI_EVENT_WPS_TIMEOUT },
+    [43] = { "CTRL-EVENT-DRIVER-STATE", 23, WIFI_EVENT_DRIVER_STATE },
+    [44] = { "CTRL-EVENT-SCAN-RESULTS", 23, WIFI_EVENT_SCAN_RESULTS },
+    [45] = { "P2P-PROV-DISC-ENTER-PIN", 23, WIFI_EVENT_P2P_PROV_DISC_ENTER_PIN },
+    [50] = { "P2P-PROV-DISC-FAILURE", 21, WIFI_EVENT_P2P_PROV_DISC_FAILURE },
+    [51] = { "CTRL-EVENT-CONNECTED", 20, WIFI_EVENT_CONNECTED },
+    [52] = { "P2P-DEVICE-FOUND", 16, WIFI_EVENT_P2P_DEVICE_FOUND },
+    [53] = { "P2P-FIND-STOPPED", 16, WIFI_EVENT_P2P_FIND_STOPPED },
+    [55] = { "P2P-GROUP-FORMATION-SUCCESS", 27, WIFI_EVENT_P2P_GROUP_FORMATION_SUCCESS },
+    [57] = { "P2P-INVITATION-RESULT", 21, WIFI_EVENT_P2P_INVITATION_RESULT },
+    [62] = { "AP-STA-CONNECTED", 16, WIFI_EVENT_AP_STA_CONNECTED },
+};
+
+static int classify_event_name(const char *name, size_t len)
+{
+    const struct wifi_event_name *e;
+    unsigned int h;
+
+    if (len < 4)
+        return WIFI_EVENT_UNKNOWN;
+    h = (len * 13 + (unsigned char)name[3] * 9 + (unsigned char)name[len - 4])
+            & (WIFI_EVENT_HASH_SIZE - 1);
+    e = &event_names[h];
+    if (e->name != NULL && e->len == len && memcmp(e->name, name, len) == 0)
+        return e->type;
+    return WIFI_EVENT_UNKNOWN;
+}
+
+static int is_event_separator(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '[' || c == ']';
+}
+
+int wifi_parse_event(const char *buf, size_t len, struct wifi_event *event)
 {
-    if (ctrl_conn != NULL) {
-        wpa_ctrl_close(ctrl_conn);
-        ctrl_conn = NULL;
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *tok;
+
+    memset(event, 0, sizeof(*event));
+
+    if (len >= IFNAMELEN && strncmp(p, IFNAME, IFNAMELEN) == 0) {
+        p += IFNAMELEN;
+        tok = p;
+        while (p < end && *p != ' ')
+            p++;
+        event->iface.ptr = tok;
+        event->iface.len = p - tok;
+        while (p < end && *p == ' ')
+            p++;
+    }
+    /* Tolerate events that still carry their "<N>" message level */
+    if (p < end && *p == '<') {
+        tok = memchr(p, '>', end - p);
+        if (tok != NULL)
+            p = tok + 1;
+    }
+
+    tok = p;
+    while (p < end && !is_event_separator(*p))
+        p++;
+    if (p == tok)
+        return -1;
+    event->name.ptr = tok;
+    event->name.len = p - tok;
+    event->type = classify_event_name(tok, p - tok);
+
+    while (p < end && event->nargs < WIFI_EVENT_MAX_ARGS) {
+        struct wifi_event_arg *arg;
+
+        while (p < end && is_event_separator(*p))
+            p++;
+        if (p >= end || *p == '\0')
+            break;
+
+        arg = &event->args[event->nargs++];
+        tok = p;
+        while (p < end && *p != '=' && !is_event_separator(*p))
+            p++;
+        if (p < end && *p == '=') {
+            arg->key.ptr = tok;
+            arg->key.len = p - tok;
+            p++;
+            tok = p;
+        }
+        if (p < end && (*p == '\'' || *p == '"') && p == tok) {
+            const char *close = memchr(p + 1, *p, end - p - 1);
+            tok = p + 1;
+            p = (close != NULL) ? close : end;
+            arg->value.ptr = tok;
+            arg->value.len = p - tok;
+            if (p < end)
+                p++;
+        } else {
+            while (p < end && !is_event_separator(*p))
+                p++;
+            arg->value.ptr = tok;
+            arg->value.len = p - tok;
+        }
     }
+    return event->type;
+}
+
+void wifi_close_sockets()
+{
+    int i;
+
+    pthread_mutex_lock(&iface_conns_lock);
+
+    /* Kick any blocked wifi_wait_for_event() and wait for it to leave */
+    signal_monitor_exit();
+    while (monitor_waiters > 0)
+        pthread_cond_wait(&conn_state_cond, &iface_conns_lock);
 
-    if (monitor_conn != NULL) {
-        wpa_ctrl_close(monitor_conn);
-        monitor_conn = NULL;
+    for (i = 0; i < WIFI_MAX_IFACES; i++) {
+        if (iface_conns[i].in_use)
+            close_iface_conn_locked(&iface_conns[i]);
     }
 
-    if (exit_sockets[0] >= 0) {
-        close(exit_sockets[0]);
-        exit_sockets[0] = -1;
+    if (monitor_epfd >= 0) {
+        close(monitor_epfd);
+        monitor_epfd = -1;
     }
+    monitor_nevents = monitor_next = 0;
 
-    if (exit_sockets[1] >= 0) {
-        close(exit_sockets[1]);
-        exit_sockets[1] = -1;
+    if (exit_event_fd >= 0) {
+        close(exit_event_fd);
+        exit_event_fd = -1;
     }
+    pthread_mutex_unlock(&iface_conns_lock);
+}
+
+void wifi_close_iface_connection(const char *ifname)
+{
+    struct wifi_iface_conn *conn;
+
+    pthread_mutex_lock(&iface_conns_lock);
+    if ((conn = find_iface_conn(ifname)) != NULL)
+        close_iface_conn_locked(conn);
+    pthread_mutex_unlock(&iface_conns_lock);
 }
 
 void wifi_close_supplicant_connection()
 {
-    char supp_status[PROPERTY_VALUE_MAX] = {'\0'};
-    int count = 50; /* wait at most 5 seconds to ensure init has stopped stupplicant */
+    char iface[PROPERTY_VALUE_MAX];
+    struct state_wait w;
 
+    /* wait at most 5 seconds to ensure init has stopped stupplicant */
+    property_get("wifi.interface", iface, WIFI_TEST_INTERFACE);
+    state_wait_begin(&w, 5000, iface);
     wifi_close_sockets();
+    wait_for_property(supplicant_prop_name, "stopped", &w);
+}
 
-    while (count-- > 0) {
-        if (property_get(supplicant_prop_name, supp_status, NULL)) {
-            if (strcmp(supp_status, "stopped") == 0)
-                return;
+int wifi_command(const char *command, char *reply, size_t *reply_len)
+{
+    return wifi_send_command(command, reply, reply_len);
+}
+
+int wifi_iface_command(const char *ifname, const char *command,
+                       char *reply, size_t *reply_len)
+{
+    return wifi_send_iface_command(ifname, command, reply, reply_len);
+}
+
+/*
+ * Library-owned reply buffers for wifi_command_alloc() and
+ * wifi_get_scan_results(). Released buffers go back to a small pool and
+ * keep their grown size, so once a large reply has been seen later ones
+ * fit on the first try. If every pooled buffer is in use, a private one
+ * is allocated and freed on release.
+ */
+#define REPLY_BUF_INITIAL	4096
+#define REPLY_BUF_MAX		(1024 * 1024)
+#define REPLY_POOL_SIZE		4
+/* free space to leave for each BSS RANGE chunk; supplicant replies are <= 4 KB */
+#define BSS_CHUNK_SPACE		8192
+/* WPA_BSS_MASK_ID; the "id=" lines are how the next chunk is found */
+#define BSS_MASK_ID		0x1
+
+struct reply_buf {
+    size_t cap;
+    int pool_slot;      /* index in reply_pool, or -1 if private */
+    char data[];
+};
+
+static struct reply_buf *reply_pool[REPLY_POOL_SIZE];
+static int reply_pool_busy[REPLY_POOL_SIZE];
+static pthread_mutex_t reply_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct reply_buf *reply_buf_get()
+{
+    struct reply_buf *rb = NULL;
+    int i, slot = -1;
+
+    pthread_mutex_lock(&reply_pool_lock);
+    for (i = 0; i < REPLY_POOL_SIZE; i++) {
+        if (reply_pool_busy[i])
+            continue;
+        /* prefer the largest idle buffer */
+        if (slot < 0 || (reply_pool[i] != NULL &&
+                (reply_pool[slot] == NULL || reply_pool[i]->cap > reply_pool[slot]->cap)))
+            slot = i;
+    }
+    if (slot >= 0) {
+        reply_pool_busy[slot] = 1;
+        rb = reply_pool[slot];
+    }
+    pthread_mutex_unlock(&reply_pool_lock);
+
+    if (rb == NULL) {
+        rb = malloc(sizeof(*rb) + REPLY_BUF_INITIAL);
+        if (rb == NULL) {
+            if (slot >= 0) {
+                pthread_mutex_lock(&reply_pool_lock);
+                reply_pool_busy[slot] = 0;
+                pthread_mutex_unlock(&reply_pool_lock);
+            }
+            return NULL;
+        }
+        rb->cap = REPLY_BUF_INITIAL;
+        rb->pool_slot = slot;
+        if (slot >= 0) {
+            pthread_mutex_lock(&reply_pool_lock);
+            reply_pool[slot] = rb;
+            pthread_mutex_unlock(&reply_pool_lock);
         }
-        usleep(100000);
     }
+    return rb;
 }
 
-int wifi_command(const char *command, char *reply, size_t *reply_len)
+/* Grows 'rb' to at least 'cap' bytes. Returns the (possibly moved) buffer. */
+static struct reply_buf *reply_buf_grow(struct reply_buf *rb, size_t cap)
 {
-    return wifi_send_command(command, reply, reply_len);
+    struct reply_buf *nrb;
+    size_t ncap = rb->cap;
+
+    while (ncap < cap)
+        ncap *= 2;
+    if (ncap > REPLY_BUF_MAX)
+        ncap = REPLY_BUF_MAX;
+    if (ncap <= rb->cap)
+        return NULL;
+    nrb = realloc(rb, sizeof(*nrb) + ncap);
+    if (nrb == NULL)
+        return NULL;
+    nrb->cap = ncap;
+    if (nrb->pool_slot >= 0) {
+        pthread_mutex_lock(&reply_pool_lock);
+        reply_pool[nrb->pool_slot] = nrb;
+        pthread_mutex_unlock(&reply_pool_lock);
+    }
+    return nrb;
+}
+
+void wifi_release_reply(char *reply)
+{
+    struct reply_buf *rb;
+
+    if (reply == NULL)
+        return;
+    rb = (struct reply_buf *)(reply - offsetof(struct reply_buf, data));
+    if (rb->pool_slot < 0) {
+        free(rb);
+        return;
+    }
+    pthread_mutex_lock(&reply_pool_lock);
+    reply_pool_busy[rb->pool_slot] = 0;
+    pthread_mutex_unlock(&reply_pool_lock);
+}
+
+/*
+ * Sends 'cmd' and stores its reply at 'off' in *prb, growing the buffer and
+ * re-issuing the command while the reply fills all the space available.
+ */
+static int send_command_into(const char *cmd, struct reply_buf **prb, size_t off,
+                             size_t min_space, size_t *reply_len)
+{
+    struct reply_buf *rb = *prb, *nrb;
+    size_t len;
+    int ret;
+
+    if (rb->cap - off < min_space) {
+        if ((nrb = reply_buf_grow(rb, off + min_space)) == NULL)
+            return -1;
+        *prb = rb = nrb;
+    }
+    for (;;) {
+        len = rb->cap - off - 1;
+        ret = wifi_send_command(cmd, rb->data + off, &len);
+        if (ret < 0 || len < rb->cap - off - 1)
+            break;
+        /* a datagram reply that fills the buffer has been truncated */
+        if ((nrb = reply_buf_grow(rb, rb->cap * 2)) == NULL) {
+            ALOGW("Reply to '%s' truncated at %zu bytes", cmd, len);
+            break;
+        }
+        *prb = rb = nrb;
+    }
+    if (ret == 0)
+        rb->data[off + len] = '\0';
+    *reply_len = len;
+    return ret;
+}
+
+int wifi_command_alloc(const char *command, char **reply, size_t *reply_len)
+{
+    struct reply_buf *rb = reply_buf_get();
+    int ret;
+
+    *reply = NULL;
+    *reply_len = 0;
+    if (rb == NULL)
+        return -1;
+    ret = send_command_into(command, &rb, 0, 0, reply_len);
+    if (ret < 0) {
+        wifi_release_reply(rb->data);
+        return ret;
+    }
+    *reply = rb->data;
+    return 0;
+}
+
+/* Returns the id of the last "id=" line in 'chunk', or -1 */
+static int last_bss_id(const char *chunk, size_t len)
+{
+    const char *p = chunk + len;
+
+    while (p > chunk) {
+        const char *line = p - 1;
+        while (line > chunk && line[-1] != '\n')
+            line--;
+        if (strncmp(line, "id=", 3) == 0)
+            return atoi(line + 3);
+        p = line;
+    }
+    return -1;
+}
+
+/* Whether 'chunk' has the "####" line marking the last BSS */
+static int has_bss_end_marker(const char *chunk, size_t len)
+{
+    const char *p = chunk;
+    const char *end = chunk + len;
+
+    while (p < end) {
+        if (end - p >= 4 && strncmp(p, "####", 4) == 0)
+            return 1;
+        p = memchr(p, '\n', end - p);
+        if (p == NULL)
+            break;
+        p++;
+    }
+    return 0;
+}
+
+int wifi_get_scan_results(const char *mask, char **reply, size_t *reply_len)
+{
+    struct reply_buf *rb;
+    char cmd[64];
+    char *end;
+    unsigned long bits;
+    size_t off = 0, len;
+    int sid = 0;
+    int ret = 0;
+
+    *reply = NULL;
+    *reply_len = 0;
+    errno = 0;
+    bits = strtoul(mask, &end, 16);
+    if (errno != 0 || end == mask || *end != '\0')
+        return -1;
+    bits |= BSS_MASK_ID;
+    rb = reply_buf_get();
+    if (rb == NULL)
+        return -1;
+
+    for (;;) {
+        snprintf(cmd, sizeof(cmd), "BSS RANGE=%d- MASK=0x%lx", sid, bits);
+        ret = send_command_into(cmd, &rb, off, BSS_CHUNK_SPACE, &len);
+        if (ret == 0 && len >= 4 && strncmp(rb->data + off, "FAIL", 4) == 0)
+            ret = -1;
+        if (ret < 0 || len == 0)
+            break;
+        off += len;
+        if (has_bss_end_marker(rb->data + off - len, len))
+            break;
+        if ((sid = last_bss_id(rb->data + off - len, len)) < 0)
+            break;
+        sid++;
+    }
+
+    /* a partial list would look complete to the caller */
+    if (ret < 0) {
+        wifi_release_reply(rb->data);
+        return ret;
+    }
+    rb->data[off] = '\0';
+    *reply = rb->data;
+    *reply_len = off;
+    return 0;
 }
 
 const char *wifi_get_fw_path(int fw_type)
@@ -912,3 +2588,162 @@ int wifi_change_fw_path(const char *fwpath)
 #endif    
     return ret;
 }
+
+static int open_uevent_socket()
+{
+    struct sockaddr_nl addr;
+    int s;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_pid = 0;    /* let the kernel pick; the process may own others */
+    addr.nl_groups = 0xffffffff;
+
+    s = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (s < 0)
+        return -1;
+    if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/*
+ * Finds the sysfs path of the device behind 'ifname' as it appears in
+ * uevent DEVPATH values, e.g. "/devices/platform/bcmdhd".
+ */
+static int get_iface_devpath(const char *ifname, char *devpath, size_t len)
+{
+    char link[PATH_MAX], real[PATH_MAX];
+
+    snprintf(link, sizeof(link), "/sys/class/net/%s/device", ifname);
+    if (realpath(link, real) == NULL || strncmp(real, "/sys/", 5) != 0)
+        return -1;
+    if (strlcpy(devpath, real + 4, len) >= len)
+        return -1;
+    return 0;
+}
+
+/*
+ * A firmware reload is complete when the firmware loader helper finishes
+ * loading our firmware (SUBSYSTEM=firmware, ACTION=remove, for a device
+ * under the interface's device or for the same firmware file), or when
+ * the driver re-announces the network interface.
+ */
+static int is_fw_ready_uevent(const char *msg, int len, const char *ifname,
+                              const char *devpath, const char *fwname)
+{
+    const char *action = NULL, *subsystem = NULL, *interface = NULL;
+    const char *path = NULL, *firmware = NULL;
+    const char *end = msg + len;
+
+    while (msg < end) {
+        if (strncmp(msg, "ACTION=", 7) == 0)
+            action = msg + 7;
+        else if (strncmp(msg, "SUBSYSTEM=", 10) == 0)
+            subsystem = msg + 10;
+        else if (strncmp(msg, "INTERFACE=", 10) == 0)
+            interface = msg + 10;
+        else if (strncmp(msg, "DEVPATH=", 8) == 0)
+            path = msg + 8;
+        else if (strncmp(msg, "FIRMWARE=", 9) == 0)
+            firmware = msg + 9;
+        msg += strlen(msg) + 1;
+    }
+    if (action == NULL || subsystem == NULL)
+        return 0;
+    if (strcmp(subsystem, "firmware") == 0) {
+        size_t n = devpath[0] ? strlen(devpath) : 0;
+        const char *base;
+
+        if (strcmp(action, "remove") != 0)
+            return 0;
+        if (n > 0 && path != NULL && strncmp(path, devpath, n) == 0 && path[n] == '/')
+            return 1;
+        if (firmware == NULL)
+            return 0;
+        base = strrchr(firmware, '/');
+        return strcmp(base ? base + 1 : firmware, fwname) == 0;
+    }
+    if (strcmp(subsystem, "net") == 0 && interface != NULL
+            && strcmp(interface, ifname) == 0)
+        return strcmp(action, "add") == 0 || strcmp(action, "change") == 0;
+    return 0;
+}
+
+int wifi_switch_fw_mode(int fw_type, int timeout_ms)
+{
+    char ifname[PROPERTY_VALUE_MAX];
+    char devpath[PATH_MAX];
+    char msg[2048];
+    const char *fwpath, *fwname;
+    int64_t start, remaining;
+    struct pollfd pfd;
+    int ufd;
+    int ret;
+
+    fwpath = wifi_get_fw_path(fw_type);
+    if (fwpath == NULL)
+        return 0;
+    property_get("wifi.interface", ifname, WIFI_TEST_INTERFACE);
+    fwname = strrchr(fwpath, '/');
+    fwname = fwname ? fwname + 1 : fwpath;
+    if (get_iface_devpath(ifname, devpath, sizeof(devpath)) < 0)
+        devpath[0] = '\0';
+
+    /* Subscribe before the reload so the ready event can't be missed */
+    ufd = open_uevent_socket();
+    if (ufd < 0) {
+        ALOGE("Cannot open uevent socket: %s", strerror(errno));
+        return -1;
+    }
+
+    start = wifi_now_ms();
+    if (wifi_change_fw_path(fwpath) < 0) {
+        close(ufd);
+        return -1;
+    }
+
+    /* The driver reloads firmware when the interface comes back up */
+    if (ifc_init() < 0) {
+        close(ufd);
+        return -1;
+    }
+    ifc_down(ifname);
+    ret = ifc_up(ifname);
+    ifc_close_unless_held();
+    if (ret < 0) {
+        ALOGE("Cannot bring %s up with firmware %s", ifname, fwpath);
+        close(ufd);
+        return -1;
+    }
+
+    ret = -2;
+    while ((remaining = start + timeout_ms - wifi_now_ms()) > 0) {
+        int len;
+
+        pfd.fd = ufd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, remaining)) <= 0)
+            continue;
+        len = TEMP_FAILURE_RETRY(recv(ufd, msg, sizeof(msg) - 1, 0));
+        if (len <= 0)
+            continue;
+        msg[len] = '\0';
+        if (is_fw_ready_uevent(msg, len, ifname, devpath, fwname)) {
+            ret = 0;
+            break;
+        }
+    }
+    close(ufd);
+
+    if (ret == 0) {
+        ALOGD("Firmware %s ready after %lld ms", fwpath,
+              (long long)(wifi_now_ms() - start));
+    } else {
+        ALOGE("Firmware %s not ready after %d ms", fwpath, timeout_ms);
+    }
+    return ret;
+}